@@ -26,35 +26,121 @@
 
 ASTERISK_FILE_VERSION(__FILE__, "$Revision: 1.1 $")
 
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define PLAYBG_HAVE_SDT
+#endif
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define PLAYBG_HAVE_URING
+#endif
+#endif
+
 #include <stdlib.h>
 #include <errno.h>
 #include <unistd.h>
 #include <string.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <math.h>
+#include <time.h>
+#include <poll.h>
+#include <signal.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
 
 #include "asterisk/lock.h"
 #include "asterisk/file.h"
+#include "asterisk/frame.h"
+#include "asterisk/translate.h"
+#include "asterisk/config.h"
+#include "asterisk/cli.h"
+#include "asterisk/app.h"
 #include "asterisk/logger.h"
 #include "asterisk/channel.h"
 #include "asterisk/options.h"
 #include "asterisk/module.h"
 #include "asterisk/utils.h"
+#include "asterisk/astdb.h"
+#include "asterisk/ulaw.h"
+#include "asterisk/alaw.h"
+
+#include "playbg_bank.h"
+#include "playbg_pace.h"
 
 #define AST_MODULE "PlayBG"
 
 #define MAX_PATH_LENGTH 256
 
+/* playlists up to this long keep their streams open between loops */
+#define PLAYBG_PARK_MAX 4
+
+/* cached audio levels are kept per block of this many ms */
+#define PLAYBG_BLOCK_MS 10
+
+/* largest frame built from cached audio: 60 ms at 16 kHz */
+#define PLAYBG_MAX_FRAME_SAMPLES 960
+
+/* Static tracepoints for bpftrace/perf/SystemTap, provider "playbg" */
+#ifdef PLAYBG_HAVE_SDT
+#define PLAYBG_PROBE2(name, a, b) DTRACE_PROBE2(playbg, name, a, b)
+#define PLAYBG_PROBE3(name, a, b, c) DTRACE_PROBE3(playbg, name, a, b, c)
+#else
+#define PLAYBG_PROBE2(name, a, b) do { } while (0)
+#define PLAYBG_PROBE3(name, a, b, c) do { } while (0)
+#endif
+
+#ifndef ARRAY_LEN
+#define ARRAY_LEN(a) (sizeof(a) / sizeof(0[a]))
+#endif
+
 static char *app1 = "StartPlayBG";
 static char *app2 = "StopPlayBG";
 static char *app3 = "ResumePlayBG";
+static char *app4 = "PausePlayBG";
 
 static char *syn1 = "Play sound in background";
 static char *syn2 = "Stop current sound in background";
 static char *syn3 = "Resume current sound set";
+static char *syn4 = "Pause current sound set, sending silence";
 
 static char *desc1 =
-"StartPlayBG(filename1&filename2&filename3&...&filenameN)\n"
+"StartPlayBG(filename1&filename2&filename3&...&filenameN[|options])\n"
 "Start playing all files (in order) separated by '&' in background.\n"
+"A file named bank:<bank>/<member> is a member of the sound bank\n"
+"<bank>.bank in the sounds directory, see playbg_mkbank.\n"
+"\n"
+"Options:\n"
+"  d - DTX: do not send frames of cached files that are silent, see\n"
+"      dtx and dtxlevel in playbg.conf.\n"
+"  g(<ms>) - Leave <ms> of silence between files instead of the gap\n"
+"      set in playbg.conf.\n"
+"  l - Live: start where the playlist would be had it been playing in a\n"
+"      loop since the epoch set in playbg.conf, so every channel hears\n"
+"      the same point, like a radio station. ResumePlayBG catches up.\n"
+"  n - Normalize cached files to the loudness set in playbg.conf.\n"
+"  o(<seconds>) - Start <seconds> into the playlist, as a whole.\n"
+"  p(<ms>) - Write frames of <ms> (20, 30, 40 or 60) instead of the\n"
+"      ptime set in playbg.conf.\n"
+"  t - Trim the silence at both ends of cached files, see trimlevel\n"
+"      in playbg.conf. Offsets then count trimmed audio only.\n"
 "\n"
 "If another stream is played while playing background sound, current background sound is interrupted.\n"
 "\n"
@@ -71,27 +157,141 @@ static char *desc2 =
 ;
 
 static char *desc3 =
-"ResumePlayBG()\n"
+"ResumePlayBG([offset])\n"
 "Resume background sound set at the right offset.\n"
+"\n"
+"If offset is given, resume at that many seconds into the playlist\n"
+"instead, or that many seconds away from the current position when\n"
+"it starts with '+' or '-'.\n"
+"\n"
+"Also ends a PausePlayBG.\n"
+;
+
+static char *desc4 =
+"PausePlayBG()\n"
+"Pause background sound set where it is. Silence is sent meanwhile,\n"
+"so the media stream stays up, until ResumePlayBG.\n"
 ;
 
 
+struct playbg_audio;
+struct playbg_bank;
+struct playbg_huge;
+struct playbg_index;
+struct playbg_silence;
+static void playbg_audio_unref(struct playbg_audio *audio);
+static void playbg_index_unref(struct playbg_index *index);
+static void playbg_index_flush(void);
+static void playbg_index_flush_dir(const char *dir);
+static void playbg_resolve_watch(const char *path);
+
+enum {
+	OPT_LIVE = (1 << 0),
+	OPT_OFFSET = (1 << 1),
+	OPT_PTIME = (1 << 2),
+	OPT_GAP = (1 << 3),
+	OPT_DTX = (1 << 4),
+	OPT_TRIM = (1 << 5),
+	OPT_NORMALIZE = (1 << 6),
+};
+
+enum {
+	OPT_ARG_OFFSET = 0,
+	OPT_ARG_PTIME,
+	OPT_ARG_GAP,
+	/* note: this entry _MUST_ be the last one in the enum */
+	OPT_ARG_ARRAY_SIZE,
+};
+
+AST_APP_OPTIONS(playbg_start_opts, {
+	AST_APP_OPTION('d', OPT_DTX),
+	AST_APP_OPTION_ARG('g', OPT_GAP, OPT_ARG_GAP),
+	AST_APP_OPTION('l', OPT_LIVE),
+	AST_APP_OPTION('n', OPT_NORMALIZE),
+	AST_APP_OPTION_ARG('o', OPT_OFFSET, OPT_ARG_OFFSET),
+	AST_APP_OPTION_ARG('p', OPT_PTIME, OPT_ARG_PTIME),
+	AST_APP_OPTION('t', OPT_TRIM),
+});
+
+/*! \brief Seeks that wait for the duration index of the playlist */
+enum {
+	PLAYBG_SEEK_NONE,
+	PLAYBG_SEEK_LIVE,	/*!< to where the epoch says, at the time */
+	PLAYBG_SEEK_ABSOLUTE,	/*!< to seek_ticks into the playlist */
+	PLAYBG_SEEK_RELATIVE,	/*!< seek_ticks away from where it is */
+};
+
 struct playbg_state {
 	char **filearray;
+	struct playbg_audio **audio;	/*!< cached audio of each file, NULL entries are played from disk */
+	struct playbg_audio *src;	/*!< cached audio currently playing */
+	struct playbg_index *index;	/*!< file durations, only built when needed */
+	int seek_pending;		/*!< PLAYBG_SEEK_*, waiting for the index */
+	int64_t seek_ticks;		/*!< where to, or how far for a relative seek */
+	unsigned int flags;		/*!< OPT_* */
 	int pos;
 	int nfiles;
 	int origwfmt;
+	int chanrate;			/*!< rate the audio array was cached for */
+	int rate;			/*!< rate state->samples is counted at */
 	int samples;
 	int sample_queue;
+	int ptime;			/*!< length of the frames written, in ms */
+	int gap;			/*!< silence between files, in ms */
+	int gap_due;			/*!< silence left before the current file, in ms */
+	int paused;			/*!< PausePlayBG: send silence, stay put */
+	const struct playbg_silence *silence;	/*!< silence frame for silfmt */
+	int silfmt;
+	int silmissing;			/*!< the last silence asked for could not be made */
+	int dtx;			/*!< suppress silent frames */
+	int dtx_run;			/*!< silent frames in a row */
+	int fr_silent;			/*!< fr is cached audio below dtxlevel */
+	int trim;			/*!< play cached files between their trim points */
+	int normalize;			/*!< play the loudness normalized cached audio */
+	struct playbg_pacer pace;	/*!< against CLOCK_MONOTONIC, start 0 to restart */
+	struct ast_filestream *stream;	/*!< chan->stream as opened for stream_pos */
+	int stream_pos;
+	char *stream_file;		/*!< full name of stream, NULL if the core resolved it */
+	struct ast_filestream *parked[PLAYBG_PARK_MAX];	/*!< streams kept open to be rewound, by position */
+	int parkgen;			/*!< playbg_resolve_generation they were parked in */
+	struct ast_smoother *smoother;	/*!< evens out frames read from disk */
+	int smoothfmt;			/*!< format the smoother was set up for */
+	int smoothbytes;		/*!< size of the frames it returns */
+	int smoothpending;		/*!< bytes fed but not yet read back */
+	int io_frames;			/*!< frames read from disk with iostats on */
+	pthread_t io_thread;		/*!< that took io_usage */
+	struct rusage io_usage;		/*!< of the thread at the start of the current run of frames */
+	struct ast_frame fr;
+	short frdata[AST_FRIENDLY_OFFSET / sizeof(short) + PLAYBG_MAX_FRAME_SAMPLES];
 };
 
 
 static void playbg_state_destroy(void *data) {
 
 	struct playbg_state *state = data;
+	int i;
+
 	if (state->filearray) {
+		for (i = 0; i < state->nfiles; i++) {
+			if (state->filearray[i])
+				ast_free(state->filearray[i]);
+		}
 		ast_free(state->filearray);
 	}
+	if (state->audio) {
+		for (i = 0; i < state->nfiles; i++)
+			playbg_audio_unref(state->audio[i]);
+		ast_free(state->audio);
+	}
+	playbg_index_unref(state->index);
+	if (state->smoother)
+		ast_smoother_free(state->smoother);
+	for (i = 0; i < PLAYBG_PARK_MAX; i++) {
+		if (state->parked[i])
+			ast_closestream(state->parked[i]);
+	}
+	if (state->stream_file)
+		ast_free(state->stream_file);
 	if (state) {
 		ast_free(state);
 	}
@@ -105,6 +305,914 @@ static const struct ast_datastore_info playbg_state_datastore_info = {
 };
 
 
+/* Event counters, shared by all channels */
+enum playbg_counter {
+	PLAYBG_CNT_OPEN_FAILED,		/*!< files that could not be opened */
+	PLAYBG_CNT_OPEN_SKIPPED,	/*!< opens skipped because the file failed recently */
+	PLAYBG_CNT_NO_STATE,		/*!< channels without a playbg datastore */
+	PLAYBG_CNT_BAD_STATE,		/*!< datastores without state */
+	PLAYBG_CNT_EMPTY_FILE,		/*!< empty playlist entries */
+	PLAYBG_CNT_FORMAT_FAILED,	/*!< write format changes that failed */
+	PLAYBG_CNT_WRITE_FAILED,	/*!< frames ast_write() refused */
+	PLAYBG_CNT_UNCACHEABLE,		/*!< files that could not be decoded for the cache */
+	PLAYBG_CNT_OVERRUNS,		/*!< generator calls that asked for more than maxburst */
+	PLAYBG_CNT_SKIPPED,		/*!< audio skipped on overrun, in PLAYBG_COUNT_RATE ticks */
+	PLAYBG_CNT_DROPPED,		/*!< audio dropped on overrun, in PLAYBG_COUNT_RATE ticks */
+	PLAYBG_CNT_SILENCE_FRAMES,	/*!< gap and pause frames written */
+	PLAYBG_CNT_DTX_FRAMES,		/*!< silent frames not written */
+	PLAYBG_CNT_STREAM_OPENS,	/*!< files opened to be played from disk */
+	PLAYBG_CNT_STREAM_REWINDS,	/*!< loops that rewound an open stream instead */
+	PLAYBG_CNT_WINDOW_PREAD,	/*!< shared windows refilled by a blocking pread() */
+	PLAYBG_CNT_WINDOW_URING,	/*!< shared windows refilled from an io_uring prefetch */
+	PLAYBG_CNT_WINDOW_DIRECT,	/*!< reads away from the window, pread() of just what was asked */
+	PLAYBG_CNT_BANK_FAILED,		/*!< bank members that could not be found or decoded */
+	PLAYBG_CNT_HUGE_FALLBACK,	/*!< huge page chunks that had to make do with less */
+	PLAYBG_CNT_SHM_HITS,		/*!< files mapped from the host wide cache instead of decoded */
+	PLAYBG_CNT_SHM_PUBLISHED,	/*!< files decoded here and put in it */
+	PLAYBG_CNT_SHM_INVALID,		/*!< objects in it that were stale, corrupt or could not be written */
+	PLAYBG_CNT_SHM_REMOVED,		/*!< objects of changed or removed files, and leftovers, deleted */
+	PLAYBG_CNT_RELOAD_SWITCHES,	/*!< channels moved to a file replaced by playbg reload */
+	PLAYBG_CNT_HINT_WILLNEED,	/*!< upcoming files hinted for readahead */
+	PLAYBG_CNT_HINT_DONTNEED,	/*!< large files dropped from the page cache after playing */
+	PLAYBG_CNT_READ_MAJFLT,		/*!< major faults while reading from disk, with iostats */
+	PLAYBG_CNT_READ_INBLOCK,	/*!< blocks read from storage while reading, with iostats */
+	PLAYBG_CNT_MAX
+};
+
+static const char * const playbg_counter_names[PLAYBG_CNT_MAX] = {
+	[PLAYBG_CNT_OPEN_FAILED] = "Failed opens",
+	[PLAYBG_CNT_OPEN_SKIPPED] = "Opens skipped (backoff)",
+	[PLAYBG_CNT_NO_STATE] = "No playbg state",
+	[PLAYBG_CNT_BAD_STATE] = "Invalid playbg state",
+	[PLAYBG_CNT_EMPTY_FILE] = "Empty playlist entries",
+	[PLAYBG_CNT_FORMAT_FAILED] = "Write format failures",
+	[PLAYBG_CNT_WRITE_FAILED] = "Write failures",
+	[PLAYBG_CNT_UNCACHEABLE] = "Files not decodable for cache",
+	[PLAYBG_CNT_OVERRUNS] = "Overruns",
+	[PLAYBG_CNT_SKIPPED] = "Audio skipped on overrun (ms)",
+	[PLAYBG_CNT_DROPPED] = "Audio dropped on overrun (ms)",
+	[PLAYBG_CNT_SILENCE_FRAMES] = "Silence frames (gap, pause)",
+	[PLAYBG_CNT_DTX_FRAMES] = "Frames suppressed (DTX)",
+	[PLAYBG_CNT_STREAM_OPENS] = "Stream opens",
+	[PLAYBG_CNT_STREAM_REWINDS] = "Stream rewinds",
+	[PLAYBG_CNT_WINDOW_PREAD] = "Window refills (pread)",
+	[PLAYBG_CNT_WINDOW_URING] = "Window refills (io_uring)",
+	[PLAYBG_CNT_WINDOW_DIRECT] = "Reads around the window",
+	[PLAYBG_CNT_BANK_FAILED] = "Missing bank members",
+	[PLAYBG_CNT_HUGE_FALLBACK] = "Huge page fallbacks",
+	[PLAYBG_CNT_SHM_HITS] = "Shared cache hits",
+	[PLAYBG_CNT_SHM_PUBLISHED] = "Shared cache publications",
+	[PLAYBG_CNT_SHM_INVALID] = "Shared cache rejects",
+	[PLAYBG_CNT_SHM_REMOVED] = "Shared cache removals",
+	[PLAYBG_CNT_RELOAD_SWITCHES] = "Switches to reloaded files",
+	[PLAYBG_CNT_HINT_WILLNEED] = "Readahead hints",
+	[PLAYBG_CNT_HINT_DONTNEED] = "Drop-behind hints",
+	[PLAYBG_CNT_READ_MAJFLT] = "Major faults reading (iostats)",
+	[PLAYBG_CNT_READ_INBLOCK] = "Blocks read from disk (iostats)",
+};
+
+static int64_t playbg_counters[PLAYBG_CNT_MAX];
+
+/* durations are counted in samples at this rate, exact for every channel rate */
+#define PLAYBG_COUNT_RATE 48000
+
+#define playbg_count_add(counter, n) __atomic_fetch_add(&playbg_counters[counter], (n), __ATOMIC_RELAXED)
+#define playbg_count(counter) playbg_count_add(counter, 1)
+
+
+/* Diagnostics */
+#define PLAYBG_DIAG_INTERVAL 10
+
+AST_MUTEX_DEFINE_STATIC(playbg_diag_lock);
+static time_t playbg_diag_next[PLAYBG_CNT_MAX];
+static int64_t playbg_diag_logged[PLAYBG_CNT_MAX];
+
+
+/*! \brief Count an event and log a summary of it at level, one of __LOG_* */
+static void __attribute__((format(printf, 3, 4))) playbg_diag(int level, enum playbg_counter counter, const char *fmt, ...)
+{
+	char buf[256];
+	va_list ap;
+	time_t now;
+	int64_t count, since;
+
+	count = playbg_count(counter) + 1;
+	now = time(NULL);
+	if (now < playbg_diag_next[counter])
+		return;
+
+	ast_mutex_lock(&playbg_diag_lock);
+	if (now < playbg_diag_next[counter]) {
+		ast_mutex_unlock(&playbg_diag_lock);
+		return;
+	}
+	playbg_diag_next[counter] = now + PLAYBG_DIAG_INTERVAL;
+	since = count - playbg_diag_logged[counter];
+	playbg_diag_logged[counter] = count;
+	ast_mutex_unlock(&playbg_diag_lock);
+
+	va_start(ap, fmt);
+	vsnprintf(buf, sizeof(buf), fmt, ap);
+	va_end(ap);
+	if (since > 1)
+		ast_log(level, _A_, "%s (%lld times since last report, %lld total)\n", buf, (long long) since, (long long) count);
+	else
+		ast_log(level, _A_, "%s\n", buf);
+}
+
+
+/* Module configuration, read from playbg.conf at load and reload time */
+#define PLAYBG_CONFIG "playbg.conf"
+
+#define DEFAULT_CACHE 1
+#define DEFAULT_CACHE_SIZE 64		/* MB */
+#define PLAYBG_CACHE_SIZE_MAX (1024 * 1024)	/* MB */
+#define DEFAULT_CACHE_MAXFILE 300	/* seconds */
+#define DEFAULT_MAX_BURST 0		/* frames, 0 unbounded */
+#define DEFAULT_PACING 0
+#define DEFAULT_PTIME 20		/* ms */
+#define DEFAULT_GAP 0			/* ms */
+#define DEFAULT_DTX 0
+#define DEFAULT_DTX_LEVEL -60		/* dBFS */
+#define DEFAULT_TRIM_LEVEL -60		/* dBFS */
+#define DEFAULT_NORMALIZE 0
+#define DEFAULT_LOUDNESS -23		/* LUFS, EBU R128 */
+#define DEFAULT_SHARED_FD 0
+#define DEFAULT_SHARED_CACHE 0
+#define DEFAULT_SHARED_CACHE_DIR "/dev/shm"
+#define DEFAULT_URING 0
+#define DEFAULT_READAHEAD 1
+#define DEFAULT_DROPBEHIND 0		/* MB, 0 never */
+#define DEFAULT_IOSTATS 0
+#define DEFAULT_WARM_SET 0
+#define DEFAULT_WARM_FILE "playbg.warm"	/* in the Asterisk var directory */
+#define DEFAULT_WARM_SIZE 256		/* files */
+#define DEFAULT_WARM_INTERVAL 300	/* seconds */
+
+enum playbg_hugepages {
+	PLAYBG_HUGE_OFF,	/*!< malloc() */
+	PLAYBG_HUGE_THP,	/*!< transparent huge pages, madvise(MADV_HUGEPAGE) */
+	PLAYBG_HUGE_EXPLICIT,	/*!< MAP_HUGETLB from the reserved pool, else as THP */
+};
+
+enum playbg_overrun_policy {
+	PLAYBG_OVERRUN_SKIP,	/*!< advance the position over what could not be sent */
+	PLAYBG_OVERRUN_DROP,	/*!< forget about it, the playlist falls behind */
+};
+
+static int playbg_cache_enabled = DEFAULT_CACHE;
+static int64_t playbg_cache_size = (int64_t) DEFAULT_CACHE_SIZE * 1024 * 1024;
+static int playbg_cache_maxfile = DEFAULT_CACHE_MAXFILE;
+static time_t playbg_live_epoch;
+static int playbg_max_burst = DEFAULT_MAX_BURST;
+static enum playbg_overrun_policy playbg_overrun = PLAYBG_OVERRUN_SKIP;
+static int playbg_pacing = DEFAULT_PACING;
+static int playbg_ptime = DEFAULT_PTIME;
+static int playbg_gap = DEFAULT_GAP;
+static int playbg_dtx = DEFAULT_DTX;
+static int playbg_dtx_level = DEFAULT_DTX_LEVEL;
+static int playbg_trim_level = DEFAULT_TRIM_LEVEL;
+static int playbg_normalize = DEFAULT_NORMALIZE;
+static double playbg_loudness_target = DEFAULT_LOUDNESS;
+static int playbg_shared_fd = DEFAULT_SHARED_FD;
+static int playbg_shared_cache = DEFAULT_SHARED_CACHE;
+static char playbg_shared_cache_dir[PATH_MAX] = DEFAULT_SHARED_CACHE_DIR;
+static int playbg_uring = DEFAULT_URING;
+static int playbg_readahead = DEFAULT_READAHEAD;
+static off_t playbg_dropbehind = DEFAULT_DROPBEHIND;
+static int playbg_iostats = DEFAULT_IOSTATS;
+static enum playbg_hugepages playbg_hugepages = PLAYBG_HUGE_OFF;
+static int playbg_warm_set = DEFAULT_WARM_SET;
+static char playbg_warm_file[PATH_MAX] = DEFAULT_WARM_FILE;
+static int playbg_warm_size = DEFAULT_WARM_SIZE;
+static int playbg_warm_interval = DEFAULT_WARM_INTERVAL;
+
+
+/*! \brief Frame lengths playbg can build, in ms: 20, 30, 40 or 60 */
+static int playbg_ptime_valid(int ms)
+{
+	return ms == 20 || ms == 30 || ms == 40 || ms == 60;
+}
+
+
+static int playbg_load_config(void)
+{
+	struct ast_config *cfg;
+	struct ast_variable *v;
+
+	playbg_cache_enabled = DEFAULT_CACHE;
+	playbg_cache_size = (int64_t) DEFAULT_CACHE_SIZE * 1024 * 1024;
+	playbg_cache_maxfile = DEFAULT_CACHE_MAXFILE;
+	playbg_live_epoch = 0;
+	playbg_max_burst = DEFAULT_MAX_BURST;
+	playbg_overrun = PLAYBG_OVERRUN_SKIP;
+	playbg_pacing = DEFAULT_PACING;
+	playbg_ptime = DEFAULT_PTIME;
+	playbg_gap = DEFAULT_GAP;
+	playbg_dtx = DEFAULT_DTX;
+	playbg_dtx_level = DEFAULT_DTX_LEVEL;
+	playbg_trim_level = DEFAULT_TRIM_LEVEL;
+	playbg_normalize = DEFAULT_NORMALIZE;
+	playbg_loudness_target = DEFAULT_LOUDNESS;
+	playbg_shared_fd = DEFAULT_SHARED_FD;
+	playbg_shared_cache = DEFAULT_SHARED_CACHE;
+	ast_copy_string(playbg_shared_cache_dir, DEFAULT_SHARED_CACHE_DIR, sizeof(playbg_shared_cache_dir));
+	playbg_uring = DEFAULT_URING;
+	playbg_readahead = DEFAULT_READAHEAD;
+	playbg_dropbehind = DEFAULT_DROPBEHIND;
+	playbg_iostats = DEFAULT_IOSTATS;
+	playbg_hugepages = PLAYBG_HUGE_OFF;
+	playbg_warm_set = DEFAULT_WARM_SET;
+	ast_copy_string(playbg_warm_file, DEFAULT_WARM_FILE, sizeof(playbg_warm_file));
+	playbg_warm_size = DEFAULT_WARM_SIZE;
+	playbg_warm_interval = DEFAULT_WARM_INTERVAL;
+
+	if (!(cfg = ast_config_load(PLAYBG_CONFIG))) {
+		if (option_debug)
+			ast_log(LOG_DEBUG, "No %s, using defaults\n", PLAYBG_CONFIG);
+		return 0;
+	}
+
+	for (v = ast_variable_browse(cfg, "general"); v; v = v->next) {
+		if (!strcasecmp(v->name, "cache")) {
+			playbg_cache_enabled = ast_true(v->value);
+		} else if (!strcasecmp(v->name, "cachesize")) {
+			char *end;
+			unsigned long long mb;
+
+			errno = 0;
+			mb = strtoull(v->value, &end, 10);
+			if (errno || end == v->value || *end || strchr(v->value, '-'))
+				ast_log(LOG_WARNING, "Invalid cachesize '%s' at line %d of %s\n", v->value, v->lineno, PLAYBG_CONFIG);
+			else
+				playbg_cache_size = (int64_t) MIN(mb, PLAYBG_CACHE_SIZE_MAX) * 1024 * 1024;
+		} else if (!strcasecmp(v->name, "cachemaxfile")) {
+			playbg_cache_maxfile = MAX(atoi(v->value), 0);
+		} else if (!strcasecmp(v->name, "liveepoch")) {
+			playbg_live_epoch = strtol(v->value, NULL, 10);
+		} else if (!strcasecmp(v->name, "pacing")) {
+			playbg_pacing = ast_true(v->value);
+		} else if (!strcasecmp(v->name, "ptime")) {
+			if (playbg_ptime_valid(atoi(v->value)))
+				playbg_ptime = atoi(v->value);
+			else
+				ast_log(LOG_WARNING, "Invalid ptime '%s' at line %d of %s\n", v->value, v->lineno, PLAYBG_CONFIG);
+		} else if (!strcasecmp(v->name, "gap")) {
+			playbg_gap = MAX(atoi(v->value), 0);
+		} else if (!strcasecmp(v->name, "dtx")) {
+			playbg_dtx = ast_true(v->value);
+		} else if (!strcasecmp(v->name, "dtxlevel")) {
+			playbg_dtx_level = MIN(atoi(v->value), 0);
+		} else if (!strcasecmp(v->name, "trimlevel")) {
+			playbg_trim_level = MIN(atoi(v->value), 0);
+		} else if (!strcasecmp(v->name, "normalize")) {
+			playbg_normalize = ast_true(v->value);
+		} else if (!strcasecmp(v->name, "loudness")) {
+			playbg_loudness_target = MIN(strtod(v->value, NULL), 0);
+		} else if (!strcasecmp(v->name, "sharedcache")) {
+			playbg_shared_cache = ast_true(v->value);
+		} else if (!strcasecmp(v->name, "sharedcachedir")) {
+			ast_copy_string(playbg_shared_cache_dir, v->value, sizeof(playbg_shared_cache_dir));
+		} else if (!strcasecmp(v->name, "sharedfd")) {
+			playbg_shared_fd = ast_true(v->value);
+		} else if (!strcasecmp(v->name, "uring")) {
+			playbg_uring = ast_true(v->value);
+		} else if (!strcasecmp(v->name, "readahead")) {
+			playbg_readahead = ast_true(v->value);
+		} else if (!strcasecmp(v->name, "dropbehind")) {
+			playbg_dropbehind = (off_t) MAX(atoi(v->value), 0) * 1024 * 1024;
+		} else if (!strcasecmp(v->name, "iostats")) {
+			playbg_iostats = ast_true(v->value);
+		} else if (!strcasecmp(v->name, "maxburst")) {
+			playbg_max_burst = MAX(atoi(v->value), 0);
+		} else if (!strcasecmp(v->name, "warmset")) {
+			playbg_warm_set = ast_true(v->value);
+		} else if (!strcasecmp(v->name, "warmfile")) {
+			ast_copy_string(playbg_warm_file, v->value, sizeof(playbg_warm_file));
+		} else if (!strcasecmp(v->name, "warmsize")) {
+			playbg_warm_size = MAX(atoi(v->value), 0);
+		} else if (!strcasecmp(v->name, "warminterval")) {
+			playbg_warm_interval = MAX(atoi(v->value), 10);
+		} else if (!strcasecmp(v->name, "hugepages")) {
+			if (!strcasecmp(v->value, "explicit"))
+				playbg_hugepages = PLAYBG_HUGE_EXPLICIT;
+			else if (!strcasecmp(v->value, "transparent") || ast_true(v->value))
+				playbg_hugepages = PLAYBG_HUGE_THP;
+			else if (ast_false(v->value))
+				playbg_hugepages = PLAYBG_HUGE_OFF;
+			else
+				ast_log(LOG_WARNING, "Invalid hugepages '%s' at line %d of %s\n", v->value, v->lineno, PLAYBG_CONFIG);
+		} else if (!strcasecmp(v->name, "overrun")) {
+			if (!strcasecmp(v->value, "skip"))
+				playbg_overrun = PLAYBG_OVERRUN_SKIP;
+			else if (!strcasecmp(v->value, "drop"))
+				playbg_overrun = PLAYBG_OVERRUN_DROP;
+			else
+				ast_log(LOG_WARNING, "Invalid overrun policy '%s' at line %d of %s\n", v->value, v->lineno, PLAYBG_CONFIG);
+		} else {
+			ast_log(LOG_WARNING, "Unknown option '%s' at line %d of %s\n", v->name, v->lineno, PLAYBG_CONFIG);
+		}
+	}
+	if (playbg_dropbehind && !playbg_shared_fd)
+		ast_log(LOG_NOTICE, "dropbehind needs sharedfd in %s, ignored\n", PLAYBG_CONFIG);
+
+	ast_config_destroy(cfg);
+	return 0;
+}
+
+
+/* Sample rates */
+static int playbg_format_rate(int format)
+{
+#ifdef AST_FORMAT_SLINEAR16
+	if (format & (AST_FORMAT_SLINEAR16 | AST_FORMAT_G722))
+		return 16000;
+#endif
+	return 8000;
+}
+
+
+/*! \brief Signed linear format for a rate, 0 if the core has none */
+static int playbg_slin_format(int rate)
+{
+	if (rate == 8000)
+		return AST_FORMAT_SLINEAR;
+#ifdef AST_FORMAT_SLINEAR16
+	if (rate == 16000)
+		return AST_FORMAT_SLINEAR16;
+#endif
+	return 0;
+}
+
+
+static int playbg_chan_rate(struct ast_channel *chan)
+{
+	int rate = playbg_format_rate(ast_best_codec(chan->nativeformats));
+
+	return playbg_slin_format(rate) ? rate : 8000;
+}
+
+
+/*! \brief Convert a sample offset between two rates */
+static int playbg_rescale(int samples, int from, int to)
+{
+	if (!from || !to || from == to)
+		return samples;
+	return (int) MIN(((int64_t) samples * to + from / 2) / from, INT_MAX);
+}
+
+
+#include "playbg_dsp.h"
+#include "playbg_resolve.h"
+#include "playbg_io.h"
+#include "playbg_mem.h"
+#include "playbg_cache.h"
+#include "playbg_warm.h"
+
+
+/*! \brief Open the file at the current playlist position on a channel */
+static struct ast_filestream *playbg_openstream(struct ast_channel *chan, const char *name, char *fn, size_t len)
+{
+	struct playbg_resolved res;
+	struct ast_filestream *fs;
+
+	*fn = '\0';
+	if (playbg_resolve_cached(name, chan->language, chan->nativeformats, &res))
+		return ast_openstream_full(chan, name, chan->language, 1);
+
+	if (!(fs = ast_readfile(res.path, res.ext, NULL, O_RDONLY, 0, 0))) {
+		/* gone behind our back, forget about it and let the core look */
+		playbg_resolve_forget(name, chan->language, chan->nativeformats);
+		return ast_openstream_full(chan, name, chan->language, 1);
+	}
+	if (ast_set_write_format(chan, fs->fmt->format)) {
+		playbg_diag(__LOG_WARNING, PLAYBG_CNT_FORMAT_FAILED, "Unable to set '%s' to format %s", chan->name, ast_getformatname(fs->fmt->format));
+		ast_closestream(fs);
+		return NULL;
+	}
+	if (playbg_shared_fd)
+		playbg_shared_attach(fs, &res);
+	ast_applystream(chan, fs);
+	chan->stream = fs;
+	playbg_resolved_file(&res, fn, len);
+	return fs;
+}
+
+
+/* Playlist duration index */
+#define PLAYBG_INDEX_RATE 48000
+#define PLAYBG_INDEX_TRIM_RATE 8000
+#define PLAYBG_TRIM_FAMILY "playbg/trim"
+#define PLAYBG_INDEX_BUCKETS 64
+
+struct playbg_index {
+	char *playlist;
+	char *language;
+	unsigned int hash;
+	int refs;
+	int variant;		/*!< trim | normalize << 1, both move the trim points */
+	int ready;		/*!< starts is filled in, under playbg_index_lock */
+	int nfiles;
+	int64_t *starts;	/*!< starts[i] is where file i begins, starts[nfiles] the total */
+	AST_LIST_ENTRY(playbg_index) list;
+	AST_LIST_ENTRY(playbg_index) queue;
+};
+
+static AST_LIST_HEAD_NOLOCK(playbg_index_bucket, playbg_index) playbg_indexes[PLAYBG_INDEX_BUCKETS];
+static AST_LIST_HEAD_NOLOCK_STATIC(playbg_index_queue, playbg_index);
+AST_MUTEX_DEFINE_STATIC(playbg_index_lock);
+static ast_cond_t playbg_index_cond;
+static pthread_t playbg_index_thread = AST_PTHREADT_NULL;
+static int playbg_index_stop;
+
+
+static void playbg_index_unref(struct playbg_index *index)
+{
+	if (!index || !ast_atomic_dec_and_test(&index->refs))
+		return;
+	if (index->playlist)
+		ast_free(index->playlist);
+	if (index->language)
+		ast_free(index->language);
+	if (index->starts)
+		ast_free(index->starts);
+	ast_free(index);
+}
+
+
+/*! \brief Forget built indexes; queued ones are still built for the channels waiting on them */
+static void playbg_index_flush(void)
+{
+	struct playbg_index *index;
+	int i;
+
+	ast_mutex_lock(&playbg_index_lock);
+	for (i = 0; i < PLAYBG_INDEX_BUCKETS; i++) {
+		while ((index = AST_LIST_REMOVE_HEAD(&playbg_indexes[i], list)))
+			playbg_index_unref(index);
+	}
+	ast_mutex_unlock(&playbg_index_lock);
+}
+
+
+/*! \brief Forget the built indexes with a file looked up in dir */
+static void playbg_index_flush_dir(const char *dir)
+{
+	struct playbg_index *index;
+	char *playlist, *files, *name;
+	int i, found;
+
+	ast_mutex_lock(&playbg_index_lock);
+	for (i = 0; i < PLAYBG_INDEX_BUCKETS; i++) {
+		AST_LIST_TRAVERSE_SAFE_BEGIN(&playbg_indexes[i], index, list) {
+			if (!(playlist = ast_strdup(index->playlist)))
+				continue;
+			files = playlist;
+			found = 0;
+			while (!found && (name = strsep(&files, "&")))
+				found = !ast_strlen_zero(name) && strncmp(name, "bank:", 5) && playbg_name_in_dir(name, index->language, dir);
+			ast_free(playlist);
+			if (!found)
+				continue;
+			AST_LIST_REMOVE_CURRENT(&playbg_indexes[i], list);
+			playbg_index_unref(index);
+		}
+		AST_LIST_TRAVERSE_SAFE_END
+	}
+	ast_mutex_unlock(&playbg_index_lock);
+}
+
+
+/*! \brief Length of a file on disk, in index ticks, 0 if it cannot be opened */
+static int64_t playbg_file_duration(const char *name, const char *language)
+{
+	struct playbg_resolved res;
+	struct ast_filestream *fs;
+	int64_t len = 0;
+
+	if (ast_strlen_zero(name) || playbg_failed_recently(name, language))
+		return 0;
+	if (!strncmp(name, "bank:", 5)) {
+		const struct playbg_bank_entry *entry;
+		struct playbg_bank *bank;
+
+		if (!(entry = playbg_bank_find(name, language, &bank)))
+			return 0;
+		len = (int64_t) playbg_bank_samples(entry) * PLAYBG_INDEX_RATE / entry->rate;
+		playbg_bank_unref(bank);
+		return len;
+	}
+	if (playbg_resolve_cached(name, language, 0, &res) || !(fs = ast_readfile(res.path, res.ext, NULL, O_RDONLY, 0, 0))) {
+		playbg_failure(name, language);
+		return 0;
+	}
+	if (!ast_seekstream(fs, 0, SEEK_END))
+		len = (int64_t) ast_tellstream(fs) * PLAYBG_INDEX_RATE / playbg_format_rate(fs->fmt->format);
+	ast_closestream(fs);
+	return len;
+}
+
+
+/*! \brief Silence trimming takes off the ends of a file, in index ticks */
+static int64_t playbg_file_trimmed(const char *name, const char *language, int normalize)
+{
+	unsigned int hash = playbg_hash(name, language, PLAYBG_INDEX_TRIM_RATE);
+	struct playbg_resolved res;
+	struct playbg_audio *audio;
+	char path[PATH_MAX + 64], key[PATH_MAX + 128], buf[128];
+	long long mtime, size, stored;
+	struct stat st;
+	int64_t cut;
+
+	if (ast_strlen_zero(name) || playbg_failed_recently(name, language))
+		return 0;
+	memset(&st, 0, sizeof(st));
+	key[0] = '\0';
+	if (strncmp(name, "bank:", 5) && !playbg_resolve_cached(name, language, 0, &res)) {
+		playbg_resolved_file(&res, path, sizeof(path));
+		/* the trim points move with the trimlevel, and with the gain when normalized */
+		if (!stat(path, &st) && snprintf(key, sizeof(key), "%s:%d:%.2f", path, playbg_trim_level,
+		    normalize ? playbg_loudness_target : 0.0) >= sizeof(key))
+			key[0] = '\0';
+		if (key[0] && !ast_db_get(PLAYBG_TRIM_FAMILY, key, buf, sizeof(buf))
+		    && sscanf(buf, "%lld:%lld:%lld", &mtime, &size, &stored) == 3
+		    && mtime == (long long) st.st_mtime && size == (long long) st.st_size)
+			return stored;
+	}
+
+	ast_mutex_lock(&playbg_cache_lock);
+	if ((audio = playbg_cache_find(name, language, PLAYBG_INDEX_TRIM_RATE, normalize, hash)))
+		playbg_audio_ref(audio);
+	ast_mutex_unlock(&playbg_cache_lock);
+	if (!audio && !(audio = strncmp(name, "bank:", 5) ? playbg_audio_decode(name, language, PLAYBG_INDEX_TRIM_RATE, normalize)
+	    : playbg_bank_decode(name, language, PLAYBG_INDEX_TRIM_RATE, normalize)))
+		return 0;
+	cut = (int64_t) (audio->samples - (audio->trim_end - audio->trim_start)) * PLAYBG_INDEX_RATE / audio->rate;
+	playbg_audio_unref(audio);
+
+	if (key[0]) {
+		snprintf(buf, sizeof(buf), "%lld:%lld:%lld", (long long) st.st_mtime, (long long) st.st_size, (long long) cut);
+		ast_db_put(PLAYBG_TRIM_FAMILY, key, buf);
+	}
+	return cut;
+}
+
+
+/*! \brief Fill in the durations of an index, on the index thread */
+static void playbg_index_build(struct playbg_index *index)
+{
+	int64_t *starts;
+	char *playlist, *files, *name;
+	int i = 0;
+
+	if (!(starts = ast_calloc(index->nfiles + 1, sizeof(*starts))) || !(playlist = ast_strdup(index->playlist))) {
+		if (starts)
+			ast_free(starts);
+		return;
+	}
+	files = playlist;
+	/* the playlist was joined with '&', empty entries are empty strings */
+	while ((name = strsep(&files, "&")) && i < index->nfiles) {
+		starts[i + 1] = playbg_file_duration(name, index->language);
+		if ((index->variant & 1) && starts[i + 1])
+			starts[i + 1] = MAX(starts[i + 1] - playbg_file_trimmed(name, index->language, index->variant >> 1), 0);
+		starts[i + 1] += starts[i];
+		i++;
+	}
+	for (; i < index->nfiles; i++)
+		starts[i + 1] = starts[i];
+	ast_free(playlist);
+
+	ast_mutex_lock(&playbg_index_lock);
+	ast_free(index->starts);
+	index->starts = starts;
+	index->ready = 1;
+	ast_mutex_unlock(&playbg_index_lock);
+	if (option_debug > 2)
+		ast_log(LOG_DEBUG, "Indexed playlist '%s': %lld ms\n", index->playlist, (long long) starts[index->nfiles] * 1000 / PLAYBG_INDEX_RATE);
+}
+
+
+static void *playbg_index_run(void *data)
+{
+	struct playbg_index *index;
+
+	ast_mutex_lock(&playbg_index_lock);
+	while (!playbg_index_stop) {
+		if (!(index = AST_LIST_REMOVE_HEAD(&playbg_index_queue, queue))) {
+			ast_cond_wait(&playbg_index_cond, &playbg_index_lock);
+			continue;
+		}
+		ast_mutex_unlock(&playbg_index_lock);
+		playbg_index_build(index);
+		/* the queue's reference */
+		playbg_index_unref(index);
+		ast_mutex_lock(&playbg_index_lock);
+	}
+	while ((index = AST_LIST_REMOVE_HEAD(&playbg_index_queue, queue)))
+		playbg_index_unref(index);
+	ast_mutex_unlock(&playbg_index_lock);
+	return NULL;
+}
+
+
+static void playbg_index_start(void)
+{
+	if (playbg_index_thread != AST_PTHREADT_NULL)
+		return;
+	playbg_index_stop = 0;
+	ast_cond_init(&playbg_index_cond, NULL);
+	if (ast_pthread_create_background(&playbg_index_thread, NULL, playbg_index_run, NULL)) {
+		ast_log(LOG_WARNING, "Unable to start playbg index thread, offsets and live playback are off\n");
+		playbg_index_thread = AST_PTHREADT_NULL;
+		ast_cond_destroy(&playbg_index_cond);
+	}
+}
+
+
+static void playbg_index_shutdown(void)
+{
+	if (playbg_index_thread == AST_PTHREADT_NULL)
+		return;
+	ast_mutex_lock(&playbg_index_lock);
+	playbg_index_stop = 1;
+	ast_cond_signal(&playbg_index_cond);
+	ast_mutex_unlock(&playbg_index_lock);
+	pthread_join(playbg_index_thread, NULL);
+	playbg_index_thread = AST_PTHREADT_NULL;
+	ast_cond_destroy(&playbg_index_cond);
+}
+
+
+/*! \brief Get the duration index of a playlist, queueing its build on first use */
+static struct playbg_index *playbg_index_get(struct playbg_state *state, const char *language)
+{
+	struct playbg_index *index;
+	char *playlist;
+	unsigned int hash;
+	int variant;
+	size_t len = 1;
+	int i;
+
+	if (playbg_index_thread == AST_PTHREADT_NULL)
+		return NULL;
+	for (i = 0; i < state->nfiles; i++)
+		len += (state->filearray[i] ? strlen(state->filearray[i]) : 0) + 1;
+	if (!(playlist = ast_calloc(1, len)))
+		return NULL;
+	for (i = 0; i < state->nfiles; i++) {
+		if (i)
+			strcat(playlist, "&");
+		if (state->filearray[i])
+			strcat(playlist, state->filearray[i]);
+	}
+	/* trimmed playlists have other durations */
+	variant = state->trim | state->normalize << 1;
+	hash = playbg_hash(playlist, language, variant);
+
+	ast_mutex_lock(&playbg_index_lock);
+	AST_LIST_TRAVERSE(&playbg_indexes[hash % PLAYBG_INDEX_BUCKETS], index, list) {
+		if (index->hash == hash && index->variant == variant && !strcmp(index->playlist, playlist) && !strcmp(index->language, language)) {
+			ast_atomic_fetchadd_int(&index->refs, 1);
+			break;
+		}
+	}
+	if (index) {
+		ast_mutex_unlock(&playbg_index_lock);
+		ast_free(playlist);
+		return index;
+	}
+
+	if (!(index = ast_calloc(1, sizeof(*index))) || !(index->starts = ast_calloc(state->nfiles + 1, sizeof(*index->starts)))
+	    || !(index->language = ast_strdup(language))) {
+		ast_mutex_unlock(&playbg_index_lock);
+		if (index) {
+			index->refs = 1;
+			playbg_index_unref(index);
+		}
+		ast_free(playlist);
+		return NULL;
+	}
+	index->playlist = playlist;
+	index->hash = hash;
+	index->variant = variant;
+	index->nfiles = state->nfiles;
+	/* ours, the table's and the queue's */
+	index->refs = 3;
+	AST_LIST_INSERT_HEAD(&playbg_indexes[hash % PLAYBG_INDEX_BUCKETS], index, list);
+	AST_LIST_INSERT_TAIL(&playbg_index_queue, index, queue);
+	ast_cond_signal(&playbg_index_cond);
+	ast_mutex_unlock(&playbg_index_lock);
+	return index;
+}
+
+
+/*! \brief Whether an index has been built, its starts are only read once it is */
+static int playbg_index_ready(struct playbg_index *index)
+{
+	int ready;
+
+	ast_mutex_lock(&playbg_index_lock);
+	ready = index->ready;
+	ast_mutex_unlock(&playbg_index_lock);
+	return ready;
+}
+
+
+/*! \brief Map a playlist offset (ticks, wrapped to the playlist length) to a file and an offset in it */
+static int playbg_index_locate(const struct playbg_index *index, int64_t offset, int *pos, int64_t *fileoffset)
+{
+	int64_t total = index->starts[index->nfiles];
+	int lo = 0, hi = index->nfiles - 1, mid;
+
+	if (total <= 0)
+		return -1;
+	offset %= total;
+	if (offset < 0)
+		offset += total;
+
+	/* last file starting at or before offset; empty files share their start with the next one */
+	while (lo < hi) {
+		mid = (lo + hi + 1) / 2;
+		if (index->starts[mid] <= offset)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+	*pos = lo;
+	*fileoffset = offset - index->starts[lo];
+	return 0;
+}
+
+
+/*! \brief Playlist offset, in index ticks, of a position in one of its files */
+static int64_t playbg_index_offset(const struct playbg_index *index, int pos, int samples, int rate)
+{
+	if (pos < 0 || pos >= index->nfiles)
+		return 0;
+	return index->starts[pos] + (int64_t) samples * PLAYBG_INDEX_RATE / (rate ? rate : PLAYBG_INDEX_RATE);
+}
+
+
+/*! \brief Move a playlist to an offset in index ticks, wrapping around its length; the index is ready */
+static int playbg_state_goto(struct playbg_state *state, struct ast_channel *chan, int64_t ticks)
+{
+	int64_t offset;
+	int pos;
+
+	if (playbg_index_locate(state->index, ticks, &pos, &offset)) {
+		playbg_diag(__LOG_WARNING, PLAYBG_CNT_EMPTY_FILE, "Playlist on %s has no playable file", chan->name);
+		return -1;
+	}
+	state->pos = pos;
+	/* playbg_seek() converts from index ticks; past 12 hours, 8 kHz ticks */
+	state->rate = PLAYBG_INDEX_RATE;
+	if (offset > INT_MAX) {
+		offset = MIN(offset / (PLAYBG_INDEX_RATE / 8000), INT_MAX);
+		state->rate = 8000;
+	}
+	state->samples = offset;
+	if (option_debug > 2)
+		ast_log(LOG_DEBUG, "Playlist on %s at file %d offset %lld at %d Hz\n", chan->name, pos, (long long) offset, state->rate);
+	return 0;
+}
+
+
+static void playbg_stream_detach(struct ast_channel *chan, struct playbg_state *state);
+
+
+/*! \brief Carry out a seek asked for by StartPlayBG or ResumePlayBG, once the index is there */
+static int playbg_state_pending(struct ast_channel *chan, struct playbg_state *state)
+{
+	int64_t ticks = state->seek_ticks;
+
+	if (state->seek_pending == PLAYBG_SEEK_NONE)
+		return 0;
+	if (!state->index && !(state->index = playbg_index_get(state, chan->language))) {
+		state->seek_pending = PLAYBG_SEEK_NONE;
+		return 0;
+	}
+	if (!playbg_index_ready(state->index))
+		return 1;
+
+	if (state->seek_pending == PLAYBG_SEEK_LIVE) {
+		struct timeval now = ast_tvnow();
+
+		ticks = ((int64_t) now.tv_sec - playbg_live_epoch) * PLAYBG_INDEX_RATE + (int64_t) now.tv_usec * PLAYBG_INDEX_RATE / 1000000;
+	} else if (state->seek_pending == PLAYBG_SEEK_RELATIVE) {
+		ticks += playbg_index_offset(state->index, state->pos, state->samples, state->rate);
+	}
+	state->seek_pending = PLAYBG_SEEK_NONE;
+	if (playbg_state_goto(state, chan, ticks))
+		return 0;
+
+	/* whatever was open belongs to the old position */
+	playbg_stream_detach(chan, state);
+	state->src = NULL;
+	state->smoothpending = 0;
+	if (state->smoother)
+		ast_smoother_reset(state->smoother, state->smoothbytes);
+	return 0;
+}
+
+
+/*! \brief Put a live playlist where it is right now */
+static void playbg_state_live(struct playbg_state *state, struct ast_channel *chan)
+{
+	state->seek_pending = PLAYBG_SEEK_LIVE;
+	playbg_state_pending(chan, state);
+}
+
+
+/*! \brief Seek a playlist to a time given in seconds, "+N" and "-N" are relative to where it is */
+static int playbg_state_seek_time(struct playbg_state *state, struct ast_channel *chan, const char *when)
+{
+	char *end;
+	double seconds;
+
+	errno = 0;
+	seconds = strtod(when, &end);
+	while (isspace((unsigned char) *end))
+		end++;
+	/* a year either way is as far as anybody means */
+	if (end == when || *end || errno || !isfinite(seconds) || fabs(seconds) > 366 * 86400.0) {
+		ast_log(LOG_WARNING, "Invalid offset '%s' on %s, not seeking\n", when, chan->name);
+		return -1;
+	}
+	state->seek_ticks = llrint(seconds * PLAYBG_INDEX_RATE);
+	state->seek_pending = (*when == '+' || *when == '-') ? PLAYBG_SEEK_RELATIVE : PLAYBG_SEEK_ABSOLUTE;
+	playbg_state_pending(chan, state);
+	return 0;
+}
+
+
+/* Streams of short playlists played from disk, parked between loops */
+static void playbg_stream_close_parked(struct playbg_state *state);
+
+
+static int playbg_stream_parkable(struct playbg_state *state)
+{
+	if (state->nfiles > (playbg_shared_fd ? PLAYBG_PARK_MAX : 1))
+		return 0;
+	if (state->parkgen != playbg_resolve_generation) {
+		playbg_stream_close_parked(state);
+		state->parkgen = playbg_resolve_generation;
+	}
+	return 1;
+}
+
+
+static void playbg_stream_detach(struct ast_channel *chan, struct playbg_state *state)
+{
+	struct ast_filestream *fs = chan->stream;
+
+	if (!fs)
+		return;
+	chan->stream = NULL;
+	if (fs == state->stream && playbg_stream_parkable(state) && !state->parked[state->stream_pos]) {
+		fs->owner = NULL;
+		state->parked[state->stream_pos] = fs;
+	} else {
+		ast_closestream(fs);
+		/* after closing, so our own shared reference is gone; only sharedfd knows the other users */
+		if (fs == state->stream && playbg_dropbehind && playbg_shared_fd && state->stream_file
+		    && !playbg_shared_users(state->stream_file))
+			playbg_hint_file(state->stream_file, POSIX_FADV_DONTNEED, playbg_dropbehind);
+	}
+	state->stream = NULL;
+}
+
+
+static struct ast_filestream *playbg_stream_unpark(struct ast_channel *chan, struct playbg_state *state, int pos)
+{
+	struct ast_filestream *fs;
+
+	if (!playbg_stream_parkable(state) || !(fs = state->parked[pos]))
+		return NULL;
+	state->parked[pos] = NULL;
+	if (chan->writeformat != fs->fmt->format && ast_set_write_format(chan, fs->fmt->format)) {
+		ast_closestream(fs);
+		return NULL;
+	}
+	ast_applystream(chan, fs);
+	chan->stream = fs;
+	return fs;
+}
+
+
+static void playbg_stream_close_parked(struct playbg_state *state)
+{
+	int i;
+
+	for (i = 0; i < PLAYBG_PARK_MAX; i++) {
+		if (state->parked[i]) {
+			ast_closestream(state->parked[i]);
+			state->parked[i] = NULL;
+		}
+	}
+}
+
+
 static void playbg_release(struct ast_channel *chan, void *data)
 {
 	struct playbg_state *state;
@@ -118,12 +1226,12 @@ static void playbg_release(struct ast_channel *chan, void *data)
 	datastore = ast_channel_datastore_find(chan, &playbg_state_datastore_info, "playbg");
 	ast_channel_unlock(chan);
 	if (!datastore) {
-		ast_log(LOG_WARNING, "No playbg state found\n");
+		playbg_diag(__LOG_WARNING, PLAYBG_CNT_NO_STATE, "No playbg state found on %s", chan->name);
 		return;
 	}
 	state = datastore->data;
 	if (!state) {
-		ast_log(LOG_WARNING, "Invalid playbg state\n");
+		playbg_diag(__LOG_WARNING, PLAYBG_CNT_BAD_STATE, "Invalid playbg state on %s", chan->name);
 		return;
 	}
 
@@ -131,13 +1239,23 @@ static void playbg_release(struct ast_channel *chan, void *data)
 		ast_closestream(chan->stream);
 		chan->stream = NULL;
 	}
+	state->stream = NULL;
+	playbg_stream_close_parked(state);
+	state->src = NULL;
+	if (state->smoother) {
+		/* a resume starts somewhere else, the tail is no use then */
+		ast_smoother_free(state->smoother);
+		state->smoother = NULL;
+	}
+	state->smoothfmt = 0;
+	state->smoothpending = 0;
 	
 	if (option_verbose > 2) {
 		ast_verbose(VERBOSE_PREFIX_3 "Release playbg on %s\n", chan->name);
 	}
 
 	if (state->origwfmt && ast_set_write_format(chan, state->origwfmt)) {
-		ast_log(LOG_WARNING, "Unable to restore channel '%s' to format '%d'\n", chan->name, state->origwfmt);
+		playbg_diag(__LOG_WARNING, PLAYBG_CNT_FORMAT_FAILED, "Unable to restore channel '%s' to format '%d'", chan->name, state->origwfmt);
 	}
 }
 
@@ -146,26 +1264,26 @@ static int playbg_seek(struct ast_channel *chan)
 {
 	struct playbg_state *state = NULL;
 	struct ast_datastore *datastore;
-	int res;
+	struct playbg_audio *audio;
+	char fn[PATH_MAX + 64];
 	int curr_pos;
+	int slin;
 
 	ast_channel_lock(chan);
 	datastore = ast_channel_datastore_find(chan, &playbg_state_datastore_info, "playbg");
 	ast_channel_unlock(chan);
 	if (!datastore) {
-		ast_log(LOG_WARNING, "No playbg state found\n");
+		playbg_diag(__LOG_WARNING, PLAYBG_CNT_NO_STATE, "No playbg state found on %s", chan->name);
 		return -1;
 	}
 	state = datastore->data;
 	if (!state) {
-		ast_log(LOG_WARNING, "Invalid playbg state\n");
+		playbg_diag(__LOG_WARNING, PLAYBG_CNT_BAD_STATE, "Invalid playbg state on %s", chan->name);
 		return -1;
 	}
 
-	if (chan->stream) {
-		ast_closestream(chan->stream);
-		chan->stream = NULL;
-	}
+	playbg_stream_detach(chan, state);
+	state->src = NULL;
 
 	curr_pos = state->pos;
 	if (curr_pos >= state->nfiles) {
@@ -176,97 +1294,625 @@ static int playbg_seek(struct ast_channel *chan)
 	if (option_debug > 2)
 		ast_log(LOG_DEBUG, "Seek currentpos=%d maxpos=%d\n", curr_pos, state->nfiles);
 	if (!state->filearray[curr_pos]) {
-		ast_log(LOG_WARNING, "Empty file at pos %d\n", curr_pos);
+		playbg_diag(__LOG_WARNING, PLAYBG_CNT_EMPTY_FILE, "Empty file at pos %d on %s", curr_pos, chan->name);
 		state->pos++;
 		return -1;
 	}
-	if (! (ast_openstream_full(chan, state->filearray[curr_pos], chan->language, 1)) ) {
-		ast_log(LOG_WARNING, "Unable to open file '%s': %s\n", state->filearray[curr_pos], strerror(errno));
-		state->pos++;
-		return -1;
+
+	PLAYBG_PROBE3(seek__start, chan->name, state->filearray[curr_pos], curr_pos);
+	if (!state->samples && state->chanrate)
+		playbg_warm_played(state->filearray[curr_pos], chan->language, state->chanrate, state->normalize);
+
+	if (state->audio[curr_pos] && state->audio[curr_pos]->stale)
+		playbg_state_refresh(state, chan, curr_pos);
+	else if (!state->audio[curr_pos] && state->chanrate && playbg_state_cacheable(state, chan, curr_pos))
+		state->audio[curr_pos] = playbg_cache_lookup(state->filearray[curr_pos], chan->language, state->chanrate, state->normalize);
+	if ((audio = state->audio[curr_pos])) {
+		slin = playbg_slin_format(audio->rate);
+		if (chan->writeformat != slin && ast_set_write_format(chan, slin)) {
+			playbg_diag(__LOG_WARNING, PLAYBG_CNT_FORMAT_FAILED, "Unable to set '%s' to signed linear", chan->name);
+			PLAYBG_PROBE3(seek__end, chan->name, curr_pos, -1);
+			state->pos++;
+			return -1;
+		}
+		state->samples = playbg_rescale(state->samples, state->rate, audio->rate);
+		state->rate = audio->rate;
+		state->src = audio;
+		if (option_debug > 2)
+			ast_log(LOG_DEBUG, "%s Playing cached '%s' at offset %d\n", chan->name, state->filearray[curr_pos], state->samples);
+		PLAYBG_PROBE3(seek__end, chan->name, curr_pos, 0);
+		return 0;
 	}
 
-	if (state->samples) {
-		res = ast_seekstream(chan->stream, state->samples, SEEK_SET);
+	if (playbg_stream_unpark(chan, state, curr_pos) && ast_seekstream(chan->stream, 0, SEEK_SET)) {
+		/* cannot rewind it, open it afresh */
+		ast_closestream(chan->stream);
+		chan->stream = NULL;
 	}
+	if (chan->stream) {
+		fn[0] = '\0';
+		playbg_count(PLAYBG_CNT_STREAM_REWINDS);
+		/* from the top, or wherever state->samples says below */
+	} else {
+		if (playbg_failed_recently(state->filearray[curr_pos], chan->language)) {
+			PLAYBG_PROBE3(seek__end, chan->name, curr_pos, -1);
+			state->pos++;
+			return -1;
+		}
+		if (! (playbg_openstream(chan, state->filearray[curr_pos], fn, sizeof(fn))) ) {
+			playbg_failure(state->filearray[curr_pos], chan->language);
+			PLAYBG_PROBE3(seek__end, chan->name, curr_pos, -1);
+			state->pos++;
+			return -1;
+		}
+		playbg_count(PLAYBG_CNT_STREAM_OPENS);
+		playbg_failure_clear(state->filearray[curr_pos], chan->language);
+	}
+	state->stream = chan->stream;
+	state->stream_pos = curr_pos;
+	if (state->stream_file)
+		ast_free(state->stream_file);
+	state->stream_file = fn[0] ? ast_strdup(fn) : NULL;
+	playbg_hint_next(chan, state, curr_pos);
+
+	/* offsets survive a change of rate, e.g. a resume on a wideband leg */
+	state->samples = playbg_rescale(state->samples, state->rate, playbg_format_rate(chan->stream->fmt->format));
+	state->rate = playbg_format_rate(chan->stream->fmt->format);
+	if (state->samples && ast_seekstream(chan->stream, state->samples, SEEK_SET) && option_debug)
+		ast_log(LOG_DEBUG, "%s Cannot seek '%s' to %d\n", chan->name, state->filearray[curr_pos], state->samples);
 	if (option_debug > 2)
 		ast_log(LOG_DEBUG, "%s Opened file '%s' at offset %d\n", chan->name, state->filearray[curr_pos], state->samples);
+	PLAYBG_PROBE3(seek__end, chan->name, curr_pos, 0);
 
 	return 0;
 }
 
 
-static struct ast_frame *playbg_readframe(struct ast_channel *chan) 
+static int playbg_advance(struct ast_channel *chan, struct playbg_state *state)
 {
-	struct playbg_state *state = NULL;
-	struct ast_datastore *datastore;
-	struct ast_frame *f = NULL;
+	if (option_verbose > 2)
+		ast_verbose(VERBOSE_PREFIX_3 "Increment to next playbg file for %s\n", chan->name);
+	state->pos++;
+	state->samples = 0;
+	state->gap_due = state->gap;
+	PLAYBG_PROBE2(file__advance, chan->name, state->pos);
+	return playbg_seek(chan);
+}
 
-	if (!(chan->stream && (f = ast_readframe(chan->stream)))) {
-		if (!playbg_seek(chan))
-			f = ast_readframe(chan->stream);
+
+/*! \brief Write format the file after the current one will play in */
+static int playbg_next_format(struct ast_channel *chan, struct playbg_state *state)
+{
+	struct playbg_resolved res;
+	struct playbg_audio *audio;
+	int next = state->pos + 1 >= state->nfiles ? 0 : state->pos + 1;
+	const char *name = state->filearray[next];
+
+	if (!name)
+		return 0;
+	if (!(audio = state->audio[next]) && state->chanrate && playbg_state_cacheable(state, chan, next))
+		audio = state->audio[next] = playbg_cache_lookup(name, chan->language, state->chanrate, state->normalize);
+	if (audio)
+		return audio->stale ? 0 : playbg_slin_format(audio->rate);
+	if (state->parkgen == playbg_resolve_generation && state->parked[next])
+		return state->parked[next]->fmt->format;
+	if (playbg_failed_recently(name, chan->language) || playbg_resolve_cached(name, chan->language, chan->nativeformats, &res))
+		return 0;
+	return res.format;
+}
+
+
+static int playbg_frame_samples(struct playbg_state *state, int rate)
+{
+	return MIN(rate * state->ptime / 1000, PLAYBG_MAX_FRAME_SAMPLES);
+}
+
+
+/*! \brief Encoded silence for the formats that have a fixed pattern */
+static int playbg_silence_fill(int format, void *buf, int bytes)
+{
+	switch (format) {
+	case AST_FORMAT_ULAW:
+		memset(buf, 0xff, bytes);
+		return 0;
+	case AST_FORMAT_ALAW:
+		memset(buf, 0xd5, bytes);
+		return 0;
+	case AST_FORMAT_SLINEAR:
+#ifdef AST_FORMAT_SLINEAR16
+	case AST_FORMAT_SLINEAR16:
+#endif
+		memset(buf, 0, bytes);
+		return 0;
 	}
-	if (!f) {
-		if (option_verbose > 2)
-			ast_verbose(VERBOSE_PREFIX_3 "Increment to next playbg file for %s\n", chan->name);
-		ast_channel_lock(chan);
-		datastore = ast_channel_datastore_find(chan, &playbg_state_datastore_info, "playbg");
-		ast_channel_unlock(chan);
-		if (!datastore) {
-			ast_log(LOG_WARNING, "No playbg state found\n");
+	return -1;
+}
+
+
+/* Pre-encoded silence */
+struct playbg_silence {
+	int format;
+	int samples;
+	int datalen;
+	AST_LIST_ENTRY(playbg_silence) list;
+	unsigned char data[0];
+};
+
+static AST_LIST_HEAD_NOLOCK_STATIC(playbg_silences, playbg_silence);
+AST_MUTEX_DEFINE_STATIC(playbg_silence_lock);
+
+
+/*! \brief Encode samples of silence in format */
+static struct playbg_silence *playbg_silence_encode(int format, int samples)
+{
+	struct playbg_silence *sil;
+	struct ast_trans_pvt *trans;
+	struct ast_frame fr, *out;
+	short zeros[PLAYBG_MAX_FRAME_SAMPLES];
+	int slin = playbg_slin_format(playbg_format_rate(format));
+	int bytes = ast_codec_get_len(format, samples);
+	int i;
+
+	if (bytes > 0 && bytes <= PLAYBG_MAX_FRAME_SAMPLES * sizeof(short) && (sil = ast_calloc(1, sizeof(*sil) + bytes))) {
+		if (!playbg_silence_fill(format, sil->data, bytes)) {
+			sil->datalen = bytes;
+			return sil;
+		}
+		ast_free(sil);
+	}
+
+	if (!slin || samples > PLAYBG_MAX_FRAME_SAMPLES || !(trans = ast_translator_build_path(format, slin)))
+		return NULL;
+
+	memset(zeros, 0, sizeof(zeros));
+	memset(&fr, 0, sizeof(fr));
+	fr.frametype = AST_FRAME_VOICE;
+	fr.subclass = slin;
+	fr.datalen = samples * sizeof(short);
+	fr.samples = samples;
+	fr.data = zeros;
+	fr.src = "playbg";
+
+	sil = NULL;
+	/* codecs with lookahead only start giving frames after a few */
+	for (i = 0; i < 10 && !sil; i++) {
+		if (!(out = ast_translate(trans, &fr, 0)))
+			continue;
+		if (out->samples == samples && out->datalen > 0 && out->datalen <= PLAYBG_MAX_FRAME_SAMPLES * sizeof(short)
+		    && (sil = ast_calloc(1, sizeof(*sil) + out->datalen))) {
+			memcpy(sil->data, out->data, out->datalen);
+			sil->datalen = out->datalen;
+		}
+	}
+	ast_translator_free_path(trans);
+	return sil;
+}
+
+
+/*! \brief Shared silence frame of samples in format */
+static const struct playbg_silence *playbg_silence_get(int format, int samples)
+{
+	struct playbg_silence *sil;
+
+	ast_mutex_lock(&playbg_silence_lock);
+	AST_LIST_TRAVERSE(&playbg_silences, sil, list) {
+		if (sil->format == format && sil->samples == samples)
+			break;
+	}
+	if (!sil && (sil = playbg_silence_encode(format, samples))) {
+		sil->format = format;
+		sil->samples = samples;
+		AST_LIST_INSERT_HEAD(&playbg_silences, sil, list);
+		if (option_debug > 1)
+			ast_log(LOG_DEBUG, "Encoded %d samples of %s silence in %d bytes\n", samples, ast_getformatname(format), sil->datalen);
+	}
+	ast_mutex_unlock(&playbg_silence_lock);
+	return sil;
+}
+
+
+static void playbg_silence_flush(void)
+{
+	struct playbg_silence *sil;
+
+	ast_mutex_lock(&playbg_silence_lock);
+	while ((sil = AST_LIST_REMOVE_HEAD(&playbg_silences, list)))
+		ast_free(sil);
+	ast_mutex_unlock(&playbg_silence_lock);
+}
+
+
+/*! \brief Next frame of a gap or a pause */
+static struct ast_frame *playbg_silence_frame(struct ast_channel *chan, struct playbg_state *state)
+{
+	const struct playbg_silence *sil = state->silence;
+	int format = chan->rawwriteformat;
+	int slin = playbg_slin_format(state->chanrate ? state->chanrate : 8000);
+
+	if (!sil || state->silfmt != format) {
+		state->silfmt = format;
+		if (!(sil = playbg_silence_get(format, playbg_format_rate(format) * state->ptime / 1000)))
+			sil = playbg_silence_get(slin, playbg_format_rate(slin) * state->ptime / 1000);
+		state->silence = sil;
+	}
+	if (sil && chan->writeformat != sil->format && ast_set_write_format(chan, sil->format)) {
+		playbg_diag(__LOG_WARNING, PLAYBG_CNT_FORMAT_FAILED, "Unable to set '%s' to format %s", chan->name, ast_getformatname(sil->format));
+		sil = NULL;
+	}
+	state->silmissing = !sil;
+
+	if (!state->paused)
+		state->gap_due = MAX(state->gap_due - state->ptime, 0);
+	if (!sil)
+		return NULL;
+
+	/* copied, the RTP stack writes its header in front of the data */
+	memcpy((char *) state->frdata + AST_FRIENDLY_OFFSET, sil->data, sil->datalen);
+	memset(&state->fr, 0, sizeof(state->fr));
+	state->fr.frametype = AST_FRAME_VOICE;
+	state->fr.subclass = sil->format;
+	state->fr.datalen = sil->datalen;
+	state->fr.samples = sil->samples;
+	state->fr.offset = AST_FRIENDLY_OFFSET;
+	state->fr.data = (char *) state->frdata + AST_FRIENDLY_OFFSET;
+	state->fr.src = "playbg";
+	state->fr_silent = 0;
+	playbg_count(PLAYBG_CNT_SILENCE_FRAMES);
+	return &state->fr;
+}
+
+
+/*! \brief Build the next frame from cached audio */
+static struct ast_frame *playbg_cache_frame(struct ast_channel *chan, struct playbg_state *state)
+{
+	struct playbg_audio *audio = state->src;
+	short *out = state->frdata + AST_FRIENDLY_OFFSET / sizeof(short);
+	int rate = audio->rate;
+	int want = playbg_frame_samples(state, rate);
+	int have = 0;
+	int hops = 0;
+	int silent = 1;
+	int n;
+
+	while (have < want) {
+		n = MIN(want - have, playbg_audio_length(state, audio) - state->samples);
+		if (n > 0) {
+			const short *src = audio->data + playbg_audio_begin(state, audio) + state->samples;
+
+			if (state->dtx && silent)
+				silent = playbg_audio_silent(audio, src - audio->data, n, playbg_dtx_level);
+			memcpy(out + have, src, n * sizeof(short));
+			state->samples += n;
+			have += n;
+			continue;
+		}
+		/* nothing left and nothing taken: let playbg_readframe move on */
+		if (!have)
 			return NULL;
+		/* a gap or another format comes next: pad, playbg_readframe moves on next time */
+		if (state->gap || ++hops > state->nfiles || playbg_next_format(chan, state) != playbg_slin_format(rate)
+		    || playbg_advance(chan, state) || !(audio = state->src))
+			break;
+	}
+	if (have < want)
+		memset(out + have, 0, (want - have) * sizeof(short));
+
+	memset(&state->fr, 0, sizeof(state->fr));
+	state->fr.frametype = AST_FRAME_VOICE;
+	state->fr.subclass = playbg_slin_format(rate);
+	state->fr.datalen = want * sizeof(short);
+	state->fr.samples = want;
+	state->fr.offset = AST_FRIENDLY_OFFSET;
+	state->fr.data = out;
+	state->fr.src = "playbg";
+	state->fr_silent = state->dtx && silent;
+	return &state->fr;
+}
+
+
+/* Formats already warned about, one bit per format */
+static unsigned int playbg_ptime_warned;
+static unsigned int playbg_tail_warned;
+AST_MUTEX_DEFINE_STATIC(playbg_warned_lock);
+
+
+static int playbg_warn_once(unsigned int *warned, int format)
+{
+	int first;
+
+	ast_mutex_lock(&playbg_warned_lock);
+	first = !(*warned & format);
+	*warned |= format;
+	ast_mutex_unlock(&playbg_warned_lock);
+	return first;
+}
+
+
+/*! \brief Point the smoother at the format of the stream just opened */
+static void playbg_smoother_setup(struct playbg_state *state, int format)
+{
+	struct ast_frame fr;
+	int samples = playbg_frame_samples(state, playbg_format_rate(format));
+	int bytes;
+
+	if (state->smoother && state->smoothfmt == format)
+		return;
+
+	state->smoothfmt = format;
+	state->smoothpending = 0;
+	bytes = ast_codec_get_len(format, samples);
+	if (bytes <= 0) {
+		if (playbg_warn_once(&playbg_ptime_warned, format))
+			ast_log(LOG_NOTICE, "Cannot cut %s into %d ms frames, sent as read from the file\n", ast_getformatname(format), state->ptime);
+		if (state->smoother)
+			ast_smoother_free(state->smoother);
+		state->smoother = NULL;
+		return;
+	}
+	memset(&fr, 0, sizeof(fr));
+	fr.frametype = AST_FRAME_VOICE;
+	fr.subclass = format;
+	fr.datalen = bytes;
+	if (ast_codec_get_samples(&fr) != samples && playbg_warn_once(&playbg_ptime_warned, format)) {
+		ast_log(LOG_NOTICE, "Cannot cut %s into %d ms frames, sending %d ms\n", ast_getformatname(format), state->ptime,
+			ast_codec_get_samples(&fr) * 1000 / playbg_format_rate(format));
+	}
+	state->smoothbytes = bytes;
+	if (state->smoother)
+		ast_smoother_reset(state->smoother, bytes);
+	else
+		state->smoother = ast_smoother_new(bytes);
+}
+
+
+/*! \brief Pad what is left in the smoother up to a whole frame */
+static struct ast_frame *playbg_smoother_tail(struct playbg_state *state)
+{
+	struct ast_frame pad;
+	char buf[PLAYBG_MAX_FRAME_SAMPLES * sizeof(short)];
+	int bytes = state->smoothbytes - state->smoothpending;
+
+	if (!state->smoother || !state->smoothpending || bytes <= 0)
+		return NULL;
+
+	if (bytes > sizeof(buf) || playbg_silence_fill(state->smoothfmt, buf, bytes)) {
+		/* no silence pattern to pad with */
+		if (playbg_warn_once(&playbg_tail_warned, state->smoothfmt))
+			ast_log(LOG_NOTICE, "Cannot pad %s with silence, partial frames at the end of files are dropped\n", ast_getformatname(state->smoothfmt));
+		return NULL;
+	}
+
+	memset(&pad, 0, sizeof(pad));
+	pad.frametype = AST_FRAME_VOICE;
+	pad.subclass = state->smoothfmt;
+	pad.datalen = bytes;
+	pad.samples = ast_codec_get_samples(&pad);
+	pad.data = buf;
+	pad.src = "playbg";
+	if (ast_smoother_feed(state->smoother, &pad))
+		return NULL;
+	state->smoothpending = 0;
+	return ast_smoother_read(state->smoother);
+}
+
+
+/*! \brief Build the next frame from the file being streamed */
+static struct ast_frame *playbg_stream_frame(struct ast_channel *chan, struct playbg_state *state)
+{
+	struct ast_frame *f;
+	int hops = 0;
+
+	if (!state->smoother || state->smoothfmt != chan->stream->fmt->format)
+		playbg_smoother_setup(state, chan->stream->fmt->format);
+
+	for (;;) {
+		if (state->smoother && (f = ast_smoother_read(state->smoother))) {
+			state->smoothpending -= f->datalen;
+			return f;
 		}
-		state = datastore->data;
-		if (!state) {
-			ast_log(LOG_WARNING, "Invalid playbg state\n");
+		if ((f = playbg_stream_read(state, chan->stream))) {
+			state->samples += f->samples;
+			if (!state->smoother)
+				return f;
+			if (ast_smoother_feed(state->smoother, f)) {
+				/* the smoother will not take it, pass it on as it is */
+				return f;
+			}
+			state->smoothpending += f->datalen;
+			continue;
+		}
+		/* end of file, nothing buffered: let playbg_readframe move on */
+		if (!state->smoother || !state->smoothpending)
 			return NULL;
+		if (state->gap || ++hops > state->nfiles || playbg_next_format(chan, state) != state->smoothfmt
+		    || playbg_advance(chan, state) || !chan->stream) {
+			f = playbg_smoother_tail(state);
+			state->smoothpending = 0;
+			if (state->smoother)
+				ast_smoother_reset(state->smoother, state->smoothbytes);
+			return f;
 		}
-		state->pos++;
-		state->samples = 0;
+	}
+}
+
+
+static struct ast_frame *playbg_srcframe(struct ast_channel *chan, struct playbg_state *state)
+{
+	int format = state->src ? playbg_slin_format(state->src->rate) : chan->stream ? chan->stream->fmt->format : 0;
+
+	if (!format)
+		return NULL;
+	/* back from silence in the raw write format */
+	if (chan->writeformat != format && ast_set_write_format(chan, format)) {
+		playbg_diag(__LOG_WARNING, PLAYBG_CNT_FORMAT_FAILED, "Unable to set '%s' to format %s", chan->name, ast_getformatname(format));
+		return NULL;
+	}
+	if (state->src)
+		return playbg_cache_frame(chan, state);
+	return playbg_stream_frame(chan, state);
+}
+
+
+static struct ast_frame *playbg_readframe(struct ast_channel *chan, struct playbg_state *state) 
+{
+	struct ast_frame *f = NULL;
+	int open;
+
+	state->silmissing = 0;
+	if (state->paused || state->gap_due > 0 || playbg_state_pending(chan, state))
+		return playbg_silence_frame(chan, state);
+
+	/* a source that ran out is done, only one not open yet is worth a seek */
+	open = state->src || chan->stream;
+	if (!(f = playbg_srcframe(chan, state)) && !open) {
 		if (!playbg_seek(chan))
-			f = ast_readframe(chan->stream);
+			f = playbg_srcframe(chan, state);
+	}
+	if (!f) {
+		if (!playbg_advance(chan, state))
+			f = state->gap_due > 0 ? playbg_silence_frame(chan, state) : playbg_srcframe(chan, state);
 	}
 
 	return f;
 }
 
 
+static int64_t playbg_monotonic_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+
+/*! \brief Deal with a generator call asking for more than a burst */
+static void playbg_overrun_handle(struct ast_channel *chan, struct playbg_state *state, int excess)
+{
+	int rate = state->chanrate ? state->chanrate : 8000;
+
+	playbg_count(PLAYBG_CNT_OVERRUNS);
+	PLAYBG_PROBE3(overrun, chan->name, excess, playbg_overrun);
+
+	if (playbg_overrun == PLAYBG_OVERRUN_DROP) {
+		playbg_count_add(PLAYBG_CNT_DROPPED, (int64_t) excess * PLAYBG_COUNT_RATE / rate);
+		return;
+	}
+
+	playbg_count_add(PLAYBG_CNT_SKIPPED, (int64_t) excess * PLAYBG_COUNT_RATE / rate);
+	excess = playbg_rescale(excess, rate, state->rate);
+	if (state->src) {
+		/* running off the end just moves on to the next file */
+		state->samples += excess;
+	} else if (chan->stream && !ast_seekstream(chan->stream, excess, SEEK_CUR)) {
+		state->samples += excess;
+	}
+}
+
+
+/* silent frames still sent at the start of a silent stretch */
+#define PLAYBG_DTX_HANGOVER 1
+
+/*! \brief A generator call in progress, for the playbg_pace_ops callbacks */
+struct playbg_gen {
+	struct ast_channel *chan;
+	struct playbg_state *state;
+	struct ast_frame *f;		/*!< built by next, for send, NULL for unsent silence */
+	int rate;			/*!< pacing rate, the channel's */
+};
+
+
+static int playbg_gen_next(void *data)
+{
+	struct playbg_gen *gen = data;
+	struct playbg_state *state = gen->state;
+
+	/* frames of native files or silence may come at another rate than the channel's */
+	if ((gen->f = playbg_readframe(gen->chan, state)))
+		return playbg_pacer_convert(&state->pace, gen->f->samples, playbg_format_rate(gen->f->subclass), gen->rate);
+	/* no silence to be had: the gap or pause goes unsent, but its time passes */
+	if (state->silmissing)
+		return playbg_frame_samples(state, gen->rate);
+	return -1;
+}
+
+
+static int playbg_gen_send(void *data)
+{
+	struct playbg_gen *gen = data;
+	struct playbg_state *state = gen->state;
+	struct ast_frame *f = gen->f;
+	int res;
+
+	if (!f)
+		return 0;
+	/* the builders have already moved state->samples on */
+	if (f == &state->fr && state->fr_silent) {
+		/* the first silent frame goes out so the peer plays silence, not the last sound */
+		if (state->dtx_run++ >= PLAYBG_DTX_HANGOVER) {
+			playbg_count(PLAYBG_CNT_DTX_FRAMES);
+			return 0;
+		}
+	} else {
+		state->dtx_run = 0;
+	}
+	res = ast_write(gen->chan, f);
+	ast_frfree(f);
+	if (res < 0) {
+		PLAYBG_PROBE2(write__failed, gen->chan->name, errno);
+		playbg_diag(__LOG_WARNING, PLAYBG_CNT_WRITE_FAILED, "Failed to write frame to '%s': %s", gen->chan->name, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+
+static void playbg_gen_overrun(void *data, int excess)
+{
+	struct playbg_gen *gen = data;
+
+	playbg_overrun_handle(gen->chan, gen->state, excess);
+}
+
+
+static const struct playbg_pace_ops playbg_gen_ops = {
+	.next = playbg_gen_next,
+	.send = playbg_gen_send,
+	.overrun = playbg_gen_overrun,
+};
+
+
+/*! \brief Generator callback */
 static int playbg_generator(struct ast_channel *chan, void *data, int len, int samples)
 {
 	struct playbg_state *state = NULL;
-	struct ast_frame *f = NULL;
 	struct ast_datastore *datastore;
-	int res = 0;
+	struct playbg_gen gen;
+	int rate, res;
 
 	ast_channel_lock(chan);
 	datastore = ast_channel_datastore_find(chan, &playbg_state_datastore_info, "playbg");
 	ast_channel_unlock(chan);
 	if (!datastore) {
-		ast_log(LOG_WARNING, "No playbg state found\n");
+		playbg_diag(__LOG_WARNING, PLAYBG_CNT_NO_STATE, "No playbg state found on %s", chan->name);
 		return -1;
 	}
 
 	state = datastore->data;
 	if (!state) {
-		ast_log(LOG_WARNING, "Invalid playbg state\n");
+		playbg_diag(__LOG_WARNING, PLAYBG_CNT_BAD_STATE, "Invalid playbg state on %s", chan->name);
 		return -1;
 	}
 
-	state->sample_queue += samples;
-
-	while (state->sample_queue > 0) {
-		if ((f = playbg_readframe(chan))) {
-			state->samples += f->samples;
-			state->sample_queue -= f->samples;
-			res = ast_write(chan, f);
-			ast_frfree(f);
-			if (res < 0) {
-				ast_log(LOG_WARNING, "Failed to write frame to '%s': %s\n", chan->name, strerror(errno));
-				return -1;
-			}
-		} else
-			return -1;	
-	}
+	PLAYBG_PROBE3(generator__entry, chan->name, samples, state->sample_queue);
+	rate = state->chanrate ? state->chanrate : 8000;
+	gen.chan = chan;
+	gen.state = state;
+	gen.rate = rate;
+	gen.f = NULL;
+	res = playbg_pace_run(&state->pace, &state->sample_queue, playbg_pacing, playbg_monotonic_us(), rate, samples,
+		playbg_max_burst * rate * state->ptime / 1000, &playbg_gen_ops, &gen);
+	PLAYBG_PROBE3(generator__exit, chan->name, res, state->sample_queue);
 	return res;
 }
 
@@ -281,7 +1927,7 @@ static void *playbg_alloc(struct ast_channel *chan, void *params)
 	ast_channel_unlock(chan);
 
 	if (!datastore) {
-		ast_log(LOG_WARNING, "No playbg state found !\n");
+		playbg_diag(__LOG_WARNING, PLAYBG_CNT_NO_STATE, "No playbg state found on %s", chan->name);
 		return NULL;
 	} else {
 		state = datastore->data;
@@ -289,6 +1935,7 @@ static void *playbg_alloc(struct ast_channel *chan, void *params)
 			return NULL;
 		}
 		state->origwfmt = chan->writeformat;
+		state->pace.start = 0;
 		if (option_verbose > 2)
 			ast_verbose(VERBOSE_PREFIX_3 "Using current stored playbg state for %s\n", chan->name);
 		return state;
@@ -304,7 +1951,7 @@ static struct ast_generator playbg_stream = {
 };
 
 
-static int playbg_start(struct ast_channel *chan, const char *opts) 
+static int playbg_start(struct ast_channel *chan, const char *opts, struct ast_flags *flags, char **opt_args) 
 {
 	int res = -1;
 	int nfiles = 0;
@@ -376,6 +2023,13 @@ static int playbg_start(struct ast_channel *chan, const char *opts)
 		ast_channel_datastore_free(datastore);
 		return -1;
 	}
+	if (!(state->audio = ast_calloc(nfiles, sizeof(*state->audio)))) {
+		ast_log(LOG_WARNING, "Unable to allocate memory for audio array\n");
+		ast_free(state->filearray);
+		ast_free(state);
+		ast_channel_datastore_free(datastore);
+		return -1;
+	}
 	int pos = 0;
 	if (strchr(opt2, '&')) {
 		while ((cur = strsep(&opt2, "&"))) {
@@ -393,6 +2047,25 @@ static int playbg_start(struct ast_channel *chan, const char *opts)
 	state->pos = 0;
 
 	state->origwfmt = chan->writeformat;
+	state->flags = flags->flags;
+	state->ptime = playbg_ptime;
+	if (ast_test_flag(flags, OPT_PTIME) && !ast_strlen_zero(opt_args[OPT_ARG_PTIME])) {
+		if (playbg_ptime_valid(atoi(opt_args[OPT_ARG_PTIME])))
+			state->ptime = atoi(opt_args[OPT_ARG_PTIME]);
+		else
+			ast_log(LOG_WARNING, "Invalid ptime '%s' on %s, using %d\n", opt_args[OPT_ARG_PTIME], chan->name, state->ptime);
+	}
+	state->gap = playbg_gap;
+	state->dtx = playbg_dtx || ast_test_flag(flags, OPT_DTX);
+	state->trim = ast_test_flag(flags, OPT_TRIM) ? 1 : 0;
+	state->normalize = playbg_normalize || ast_test_flag(flags, OPT_NORMALIZE);
+	if (ast_test_flag(flags, OPT_GAP) && !ast_strlen_zero(opt_args[OPT_ARG_GAP]))
+		state->gap = MAX(atoi(opt_args[OPT_ARG_GAP]), 0);
+	playbg_state_cache(state, chan);
+	if (ast_test_flag(flags, OPT_LIVE))
+		playbg_state_live(state, chan);
+	else if (ast_test_flag(flags, OPT_OFFSET) && !ast_strlen_zero(opt_args[OPT_ARG_OFFSET]))
+		playbg_state_seek_time(state, chan, opt_args[OPT_ARG_OFFSET]);
 
 	datastore->data = state;
 
@@ -412,12 +2085,12 @@ static void playbg_stop(struct ast_channel *chan)
 	datastore = ast_channel_datastore_find(chan, &playbg_state_datastore_info, "playbg");
 	ast_channel_unlock(chan);
 	if (!datastore) {
-		ast_log(LOG_WARNING, "No playbg state found\n");
+		playbg_diag(__LOG_WARNING, PLAYBG_CNT_NO_STATE, "No playbg state found on %s", chan->name);
 		return;
 	}
 	state = datastore->data;
 	if (!state) {
-		ast_log(LOG_WARNING, "Invalid playbg state\n");
+		playbg_diag(__LOG_WARNING, PLAYBG_CNT_BAD_STATE, "Invalid playbg state on %s", chan->name);
 		return;
 	}
 	ast_channel_lock(chan);
@@ -443,16 +2116,24 @@ static int playbg_exec_stop(struct ast_channel *chan, void *data)
 static int playbg_exec_start(struct ast_channel *chan, void *data)
 {
 	int res = 0;
-	const char *cur;
-	char *opt;
-	int nfiles = 0;
+	char *parse;
+	struct ast_flags flags = { 0 };
+	char *opt_args[OPT_ARG_ARRAY_SIZE] = { NULL, };
+	AST_DECLARE_APP_ARGS(args,
+		AST_APP_ARG(files);
+		AST_APP_ARG(options);
+	);
 
 	if (!data || !strlen(data))
 		return -1;
 
-	opt = ast_strdupa(data);
+	parse = ast_strdupa(data);
+	AST_STANDARD_APP_ARGS(args, parse);
 
-	res = playbg_start(chan, opt);
+	if (!ast_strlen_zero(args.options))
+		ast_app_parse_options(playbg_start_opts, &flags, opt_args, args.options);
+
+	res = playbg_start(chan, args.files, &flags, opt_args);
 
 	return res;
 }
@@ -468,27 +2149,203 @@ static int playbg_exec_resume(struct ast_channel *chan, void *data)
 	datastore = ast_channel_datastore_find(chan, &playbg_state_datastore_info, "playbg");
 	ast_channel_unlock(chan);
 	if (!datastore) {
-		ast_log(LOG_WARNING, "No playbg state found\n");
+		playbg_diag(__LOG_WARNING, PLAYBG_CNT_NO_STATE, "No playbg state found on %s", chan->name);
 		return -1;
 	}
 	state = datastore->data;
 	if (!state) {
-		ast_log(LOG_WARNING, "Invalid playbg state\n");
+		playbg_diag(__LOG_WARNING, PLAYBG_CNT_BAD_STATE, "Invalid playbg state on %s", chan->name);
 		return -1;
 	}
-	state->origwfmt = chan->writeformat;
+	/* while it plays, writeformat is ours; playbg_alloc() takes the real one after release */
+	if (chan->generator != &playbg_stream)
+		state->origwfmt = chan->writeformat;
+	state->paused = 0;
+	/* the channel may have moved to another rate since StartPlayBG */
+	playbg_state_cache(state, chan);
+	if (state->flags & OPT_LIVE)
+		playbg_state_live(state, chan);
+	else if (!ast_strlen_zero(data))
+		playbg_state_seek_time(state, chan, data);
 
 	res = ast_activate_generator(chan, &playbg_stream, NULL);
 	return res;
 }
 
 
+static int playbg_exec_pause(struct ast_channel *chan, void *data)
+{
+	struct ast_datastore *datastore = NULL;
+	struct playbg_state *state = NULL;
+
+	ast_channel_lock(chan);
+	datastore = ast_channel_datastore_find(chan, &playbg_state_datastore_info, "playbg");
+	ast_channel_unlock(chan);
+	if (!datastore) {
+		playbg_diag(__LOG_WARNING, PLAYBG_CNT_NO_STATE, "No playbg state found on %s", chan->name);
+		return -1;
+	}
+	state = datastore->data;
+	if (!state) {
+		playbg_diag(__LOG_WARNING, PLAYBG_CNT_BAD_STATE, "Invalid playbg state on %s", chan->name);
+		return -1;
+	}
+	state->paused = 1;
+	if (option_verbose > 2)
+		ast_verbose(VERBOSE_PREFIX_3 "Pause playbg on %s\n", chan->name);
+
+	/* interrupted by another stream: bring the generator back for the silence */
+	if (chan->generator != &playbg_stream)
+		return ast_activate_generator(chan, &playbg_stream, NULL);
+	return 0;
+}
+
+
+static int playbg_bank_count(void)
+{
+	struct playbg_bank *bank;
+	int n = 0;
+
+	ast_mutex_lock(&playbg_bank_lock);
+	AST_LIST_TRAVERSE(&playbg_banks, bank, list)
+		n++;
+	ast_mutex_unlock(&playbg_bank_lock);
+	return n;
+}
+
+
+static char playbg_show_stats_usage[] =
+"Usage: playbg show stats\n"
+"       Show playbg counters and cache usage.\n";
+
+static int handle_playbg_show_stats(int fd, int argc, char *argv[])
+{
+	int i;
+
+	if (argc != 3)
+		return RESULT_SHOWUSAGE;
+
+	ast_cli(fd, "%-32s %s\n", "Audio kernels", playbg_dsp->name);
+	ast_cli(fd, "%-32s %lld/%lld kB\n", "Audio cache", (long long) playbg_cache_bytes / 1024, (long long) playbg_cache_size / 1024);
+	ast_cli(fd, "%-32s %d\n", "Shared file handles", playbg_shared_count);
+	ast_cli(fd, "%-32s %d\n", "Sound banks mapped", playbg_bank_count());
+	ast_cli(fd, "%-32s %lld kB\n", "Huge page memory", (long long) __atomic_load_n(&playbg_huge_bytes, __ATOMIC_RELAXED) / 1024);
+	for (i = 0; i < PLAYBG_CNT_MAX; i++) {
+		int64_t n = __atomic_load_n(&playbg_counters[i], __ATOMIC_RELAXED);
+
+		if (i == PLAYBG_CNT_SKIPPED || i == PLAYBG_CNT_DROPPED)
+			n = n * 1000 / PLAYBG_COUNT_RATE;
+		ast_cli(fd, "%-32s %lld\n", playbg_counter_names[i], (long long) n);
+	}
+	return RESULT_SUCCESS;
+}
+
+
+static char playbg_show_warm_usage[] =
+"Usage: playbg show warm\n"
+"       Show how the warm set was loaded and how much of what has been\n"
+"       played since it covers, with its best files.\n";
+
+static int handle_playbg_show_warm(int fd, int argc, char *argv[])
+{
+	struct playbg_warm **best;
+	struct playbg_warmup warmup;
+	int i, n, hits, plays;
+
+	if (argc != 3)
+		return RESULT_SHOWUSAGE;
+	if (!playbg_warm_set && playbg_warm_thread == AST_PTHREADT_NULL) {
+		ast_cli(fd, "Warm set is off, see warmset in %s\n", PLAYBG_CONFIG);
+		return RESULT_SUCCESS;
+	}
+
+	ast_mutex_lock(&playbg_warm_lock);
+	warmup = playbg_warmup;
+	hits = playbg_warm_hits;
+	plays = playbg_warm_plays;
+	ast_mutex_unlock(&playbg_warm_lock);
+	if (warmup.elapsed < 0)
+		ast_cli(fd, "%-32s running for %ld s\n", "Warm-up", (long) (time(NULL) - warmup.started));
+	else
+		ast_cli(fd, "%-32s %lld ms\n", "Warm-up took", (long long) warmup.elapsed);
+	ast_cli(fd, "%-32s %d\n", "Files in warm set", warmup.files);
+	ast_cli(fd, "%-32s %d cached, %d hinted, %d failed\n", "Loaded", warmup.cached, warmup.hinted, warmup.failed);
+	ast_cli(fd, "%-32s %d of %d (%d%%)\n", "Plays of warmed files", hits, plays, plays ? hits * 100 / plays : 0);
+
+	ast_mutex_lock(&playbg_warm_lock);
+	ast_cli(fd, "%-32s %d\n", "Files tracked", playbg_warm_count);
+	if ((best = playbg_warm_best(10, &n))) {
+		ast_cli(fd, "\n%-8s %-8s %-6s %-6s %s\n", "Plays", "Score", "Lang", "Warmed", "File");
+		for (i = 0; i < n; i++) {
+			ast_cli(fd, "%-8d %-8.1f %-6s %-6s %s\n", best[i]->plays, best[i]->score,
+				ast_strlen_zero(best[i]->language) ? "-" : best[i]->language, best[i]->warmed ? "yes" : "no", best[i]->name);
+		}
+		ast_free(best);
+	}
+	ast_mutex_unlock(&playbg_warm_lock);
+	return RESULT_SUCCESS;
+}
+
+
+static char playbg_reload_usage[] =
+"Usage: playbg reload\n"
+"       Decode again, in the background, the cached files that changed on\n"
+"       disk. Channels switch to the new versions at their next file.\n";
+
+static int handle_playbg_reload(int fd, int argc, char *argv[])
+{
+	struct playbg_reload_stats last;
+
+	if (argc != 2)
+		return RESULT_SHOWUSAGE;
+	if (playbg_reload_start()) {
+		ast_cli(fd, "A playbg reload is already running\n");
+		return RESULT_SUCCESS;
+	}
+	ast_cli(fd, "PlayBG reload started\n");
+	ast_mutex_lock(&playbg_cache_lock);
+	last = playbg_reload_last;
+	ast_mutex_unlock(&playbg_cache_lock);
+	if (last.when)
+		ast_cli(fd, "Last one: %d files checked, %d updated, %d dropped\n", last.checked, last.swapped, last.removed);
+	return RESULT_SUCCESS;
+}
+
+
+static struct ast_cli_entry cli_playbg[] = {
+	{ { "playbg", "show", "stats", NULL },
+	handle_playbg_show_stats, "Show playbg counters",
+	playbg_show_stats_usage },
+
+	{ { "playbg", "show", "warm", NULL },
+	handle_playbg_show_warm, "Show the playbg warm set",
+	playbg_show_warm_usage },
+
+	{ { "playbg", "reload", NULL },
+	handle_playbg_reload, "Reload changed files in the playbg cache",
+	playbg_reload_usage },
+};
+
+
 static int load_module(void)
 {
 	int res = 0;
+
+	playbg_dsp_init();
+	playbg_load_config();
+	if (playbg_shared_cache && !playbg_shm_open())
+		playbg_shm_sweep();
+	playbg_inotify_start();
+	playbg_uring_start();
+	playbg_build_start();
+	playbg_index_start();
+	playbg_warm_start();
+	ast_cli_register_multiple(cli_playbg, sizeof(cli_playbg) / sizeof(struct ast_cli_entry));
+
 	res |= ast_register_application(app1, playbg_exec_start, syn1, desc1);
 	res |= ast_register_application(app2, playbg_exec_stop, syn2, desc2);
 	res |= ast_register_application(app3, playbg_exec_resume, syn3, desc3);
+	res |= ast_register_application(app4, playbg_exec_pause, syn4, desc4);
 	return res;
 }
 
@@ -496,15 +2353,57 @@ static int load_module(void)
 static int unload_module(void)
 {
 	int res = 0;
+	ast_cli_unregister_multiple(cli_playbg, sizeof(cli_playbg) / sizeof(struct ast_cli_entry));
 	res |= ast_unregister_application(app1);
 	res |= ast_unregister_application(app2);
 	res |= ast_unregister_application(app3);
+	res |= ast_unregister_application(app4);
+	playbg_inotify_shutdown();
+	playbg_uring_shutdown();
+	playbg_warm_shutdown();
+	playbg_reload_shutdown();
+	playbg_index_shutdown();
+	playbg_build_shutdown();
+	playbg_resolve_flush();
+	playbg_failure_flush();
+	playbg_index_flush();
+	playbg_cache_purge();
+	playbg_huge_flush();
+	playbg_bank_flush();
+	playbg_silence_flush();
+	playbg_shm_close();
 	return res;
 }
 
 
+static int reload(void)
+{
+	playbg_load_config();
+	/* rebuilt banks are mapped again, cached members stay as they are */
+	playbg_bank_flush();
+	/* files that did not fit may now */
+	playbg_build_flush();
+	if (playbg_shared_cache && !playbg_shm_open())
+		playbg_shm_sweep();
+	else
+		playbg_shm_close();
+	/* turning it off stops the thread and frees its buffers */
+	if (playbg_uring)
+		playbg_uring_start();
+	else
+		playbg_uring_shutdown();
+	/* turning it off writes the set a last time and stops the thread */
+	if (playbg_warm_set)
+		playbg_warm_start();
+	else
+		playbg_warm_shutdown();
+	return 0;
+}
+
+
 AST_MODULE_INFO(ASTERISK_GPL_KEY, AST_MODFLAG_DEFAULT, "Play BG",
 	.load = load_module,
 	.unload = unload_module,
+	.reload = reload,
 );
 
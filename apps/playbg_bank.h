@@ -0,0 +1,62 @@
+/*
+ * See http://www.asterisk.org for more information about
+ * the Asterisk project. Please do not directly contact
+ * any of the maintainers of this project for assistance;
+ * the project provides a web site, mailing lists and IRC
+ * channels for your use.
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+*/
+
+/*! \file
+ *
+ * \brief Layout of playbg sound banks
+ */
+
+#ifndef _PLAYBG_BANK_H
+#define _PLAYBG_BANK_H
+
+#include <stdint.h>
+
+#define PLAYBG_BANK_MAGIC "PLAYBGK"
+#define PLAYBG_BANK_VERSION 1
+#define PLAYBG_BANK_BYTEORDER 0x01020304
+#define PLAYBG_BANK_ALIGN 64
+#define PLAYBG_BANK_NAME 64		/* including the terminating NUL */
+#define PLAYBG_BANK_EXT ".bank"
+
+/*! \brief Sample encodings of bank members */
+enum playbg_bank_encoding {
+	PLAYBG_BANK_SLIN = 0,		/*!< signed 16 bit linear */
+	PLAYBG_BANK_ULAW = 1,
+	PLAYBG_BANK_ALAW = 2,
+};
+
+struct playbg_bank_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t byteorder;
+	uint32_t count;			/*!< entries in the index, right after the header */
+	uint32_t reserved;
+	uint64_t size;			/*!< of the whole file */
+};
+
+struct playbg_bank_entry {
+	char name[PLAYBG_BANK_NAME];	/*!< e.g. "digits/1" or "digits/fr/1", no extension */
+	uint32_t encoding;
+	uint32_t rate;
+	uint64_t offset;		/*!< from the start of the file */
+	uint64_t length;		/*!< in bytes */
+};
+
+/*! \brief Whether app_playbg can play a member in this encoding at this rate */
+static inline int playbg_bank_format_valid(uint32_t encoding, uint32_t rate)
+{
+	if (encoding > PLAYBG_BANK_ALAW)
+		return 0;
+	return rate == 8000 || rate == 16000 || rate == 32000 || rate == 48000;
+}
+
+#endif /* _PLAYBG_BANK_H */
@@ -0,0 +1,888 @@
+/*
+ * See http://www.asterisk.org for more information about
+ * the Asterisk project. Please do not directly contact
+ * any of the maintainers of this project for assistance;
+ * the project provides a web site, mailing lists and IRC
+ * channels for your use.
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+*/
+
+/*! \file
+ *
+ * \brief Cache of decoded audio of app_playbg
+ */
+
+#ifndef _PLAYBG_CACHE_H
+#define _PLAYBG_CACHE_H
+
+/* Audio cache */
+#define PLAYBG_CACHE_BUCKETS 256
+
+struct playbg_audio {
+	char *name;
+	char *language;
+	unsigned int hash;
+	int rate;
+	int samples;
+	int normalized;			/*!< gain to the loudness target applied */
+	short *data;
+	struct playbg_bank *bank;	/*!< data is in its map, not ours to free */
+	struct playbg_huge *huge;	/*!< or in this chunk of huge pages */
+	void *shm;			/*!< or in this host wide shared object */
+	size_t shmsize;
+	signed char *levels;		/*!< level of each PLAYBG_BLOCK_MS block, in dBFS */
+	int nlevels;
+	int trim_start;			/*!< first sample above trimlevel, less a block */
+	int trim_end;			/*!< past the last one, plus a block */
+	char *source;			/*!< file decoded, or bank mapped */
+	time_t mtime;			/*!< of source then */
+	off_t size;
+	int stale;			/*!< replaced in the cache by playbg reload */
+	int refs;
+	AST_LIST_ENTRY(playbg_audio) list;
+};
+
+static AST_LIST_HEAD_NOLOCK(playbg_bucket, playbg_audio) playbg_cache[PLAYBG_CACHE_BUCKETS];
+AST_MUTEX_DEFINE_STATIC(playbg_cache_lock);
+static int64_t playbg_cache_bytes;
+
+
+static void playbg_audio_free(struct playbg_audio *audio)
+{
+	if (audio->bank)
+		playbg_bank_unref(audio->bank);
+	else if (audio->huge)
+		playbg_huge_unref(audio->huge);
+	else if (audio->shm)
+		munmap(audio->shm, audio->shmsize);
+	else if (audio->data)
+		ast_free(audio->data);
+	if (audio->levels)
+		ast_free(audio->levels);
+	if (audio->name)
+		ast_free(audio->name);
+	if (audio->language)
+		ast_free(audio->language);
+	if (audio->source)
+		ast_free(audio->source);
+	ast_free(audio);
+}
+
+
+static struct playbg_audio *playbg_audio_ref(struct playbg_audio *audio)
+{
+	ast_atomic_fetchadd_int(&audio->refs, 1);
+	return audio;
+}
+
+
+static void playbg_audio_unref(struct playbg_audio *audio)
+{
+	if (audio && ast_atomic_dec_and_test(&audio->refs))
+		playbg_audio_free(audio);
+}
+
+
+/*! \brief Level of each block of cached audio, and the trim points */
+static void playbg_audio_levels(struct playbg_audio *audio)
+{
+	int block = audio->rate * PLAYBG_BLOCK_MS / 1000;
+	int i, n;
+	int64_t energy;
+	double db;
+
+	audio->nlevels = (audio->samples + block - 1) / block;
+	if (!(audio->levels = ast_malloc(audio->nlevels))) {
+		audio->nlevels = 0;
+		return;
+	}
+	for (i = 0; i < audio->nlevels; i++) {
+		n = MIN(block, audio->samples - i * block);
+		energy = playbg_dsp->dot(audio->data + i * block, audio->data + i * block, n);
+		db = energy ? 10 * log10((double) energy / n / (32768.0 * 32768.0)) : -127;
+		audio->levels[i] = (signed char) MAX(MIN(db, 0), -127);
+	}
+
+	for (i = 0; i < audio->nlevels && audio->levels[i] <= playbg_trim_level; i++);
+	audio->trim_start = MAX(i - 1, 0) * block;
+	for (i = audio->nlevels - 1; i >= 0 && audio->levels[i] <= playbg_trim_level; i--);
+	audio->trim_end = i < 0 ? audio->trim_start : MIN((i + 2) * block, audio->samples);
+}
+
+
+/*! \brief Whether samples [start, start + n) of audio are all at or below level */
+static int playbg_audio_silent(const struct playbg_audio *audio, int start, int n, int level)
+{
+	int block = audio->rate * PLAYBG_BLOCK_MS / 1000;
+	int b;
+
+	if (!audio->levels)
+		return 0;
+	for (b = start / block; b <= (start + n - 1) / block && b < audio->nlevels; b++) {
+		if (audio->levels[b] > level)
+			return 0;
+	}
+	return 1;
+}
+
+
+/*! \brief First sample of cached audio a state plays */
+static int playbg_audio_begin(const struct playbg_state *state, const struct playbg_audio *audio)
+{
+	return state->trim ? audio->trim_start : 0;
+}
+
+
+/*! \brief Number of samples of cached audio a state plays, from playbg_audio_begin() */
+static int playbg_audio_length(const struct playbg_state *state, const struct playbg_audio *audio)
+{
+	return state->trim ? audio->trim_end - audio->trim_start : audio->samples;
+}
+
+
+/*! \brief Wrap decoded audio for the cache */
+static struct playbg_audio *playbg_audio_new(const char *name, const char *language, int rate, int normalize,
+	short *data, int samples)
+{
+	struct playbg_audio *audio;
+
+	if (!(audio = ast_calloc(1, sizeof(*audio))))
+		return NULL;
+	audio->name = ast_strdup(name);
+	audio->language = ast_strdup(language);
+	if (!audio->name || !audio->language) {
+		playbg_audio_free(audio);
+		return NULL;
+	}
+	audio->rate = rate;
+	audio->samples = samples;
+	audio->normalized = normalize;
+	audio->trim_end = samples;
+	audio->data = data;
+	audio->hash = playbg_hash(name, language, rate);
+	audio->refs = 1;
+	playbg_audio_levels(audio);
+	return audio;
+}
+
+
+/*! \brief Note what audio was made from, for playbg reload to tell when it changes */
+static void playbg_audio_source(struct playbg_audio *audio, const char *path, time_t mtime, off_t size)
+{
+	audio->source = ast_strdup(path);
+	audio->mtime = mtime;
+	audio->size = size;
+}
+
+
+/*! \brief Move freshly decoded audio from malloc() to huge pages, when so configured */
+static void playbg_audio_place(struct playbg_audio *audio)
+{
+	short *copy;
+
+	if (playbg_hugepages != PLAYBG_HUGE_OFF && (copy = playbg_huge_copy(audio->data, audio->samples, &audio->huge))) {
+		ast_free(audio->data);
+		audio->data = copy;
+	}
+}
+
+
+/*! \brief Map a published file, if there is a good one */
+static struct playbg_audio *playbg_shm_attach(const char *name, const char *language, int rate, int normalize,
+	const char *path, const struct stat *src)
+{
+	const struct playbg_shm_header *header;
+	struct playbg_audio *audio;
+	char key[sizeof(header->key)], fn[PATH_MAX];
+	struct stat st;
+	void *map;
+	int fd;
+
+	if (playbg_shm_key(path, rate, normalize, key, sizeof(key), fn, sizeof(fn)) || (fd = open(fn, O_RDONLY | O_NOFOLLOW)) < 0)
+		return NULL;
+	if (fstat(fd, &st) || !S_ISREG(st.st_mode) || st.st_size < PLAYBG_SHM_HEADER) {
+		close(fd);
+		return NULL;
+	}
+	if (!playbg_shm_private(&st)) {
+		playbg_diag(__LOG_NOTICE, PLAYBG_CNT_SHM_INVALID, "Shared cache object '%s' is not ours or writable by others, ignored", fn);
+		close(fd);
+		return NULL;
+	}
+	if ((map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+		close(fd);
+		return NULL;
+	}
+	close(fd);
+
+	header = map;
+	if (memcmp(header->magic, PLAYBG_SHM_MAGIC, sizeof(header->magic)) || header->version != PLAYBG_SHM_VERSION
+	    || header->byteorder != PLAYBG_BANK_BYTEORDER || strncmp(header->key, key, sizeof(header->key))
+	    || header->mtime != (int64_t) src->st_mtime || header->size != (int64_t) src->st_size || header->rate != rate
+	    || st.st_size != PLAYBG_SHM_HEADER + (off_t) header->samples * sizeof(short)
+	    || playbg_shm_checksum((short *) ((char *) map + PLAYBG_SHM_HEADER), header->samples) != header->checksum) {
+		if (option_debug)
+			ast_log(LOG_DEBUG, "Shared cache object '%s' for '%s' is stale or damaged\n", fn, path);
+		playbg_count(PLAYBG_CNT_SHM_INVALID);
+		munmap(map, st.st_size);
+		return NULL;
+	}
+
+	if (!(audio = playbg_audio_new(name, language, rate, normalize, (short *) ((char *) map + PLAYBG_SHM_HEADER), header->samples))) {
+		munmap(map, st.st_size);
+		return NULL;
+	}
+	audio->shm = map;
+	audio->shmsize = st.st_size;
+	return audio;
+}
+
+
+/*! \brief Publish decoded audio and switch it over to the published copy */
+static int playbg_shm_publish(struct playbg_audio *audio, const char *path, const struct stat *src)
+{
+	struct playbg_shm_header *header;
+	struct playbg_audio *mapped;
+	char key[sizeof(header->key)], fn[PATH_MAX], tmp[PATH_MAX + 32];
+	size_t size = PLAYBG_SHM_HEADER + (size_t) audio->samples * sizeof(short);
+	int fd, res = -1;
+
+	if (playbg_shm_key(path, audio->rate, audio->normalized, key, sizeof(key), fn, sizeof(fn)))
+		return -1;
+	if (strlen(key) >= sizeof(key) - 1 || !(header = ast_calloc(1, sizeof(*header))))
+		return -1;
+	memcpy(header->magic, PLAYBG_SHM_MAGIC, sizeof(header->magic));
+	header->version = PLAYBG_SHM_VERSION;
+	header->byteorder = PLAYBG_BANK_BYTEORDER;
+	header->mtime = src->st_mtime;
+	header->size = src->st_size;
+	header->rate = audio->rate;
+	header->samples = audio->samples;
+	header->checksum = playbg_shm_checksum(audio->data, audio->samples);
+	ast_copy_string(header->key, key, sizeof(header->key));
+
+	/* two builds of one file in this process, or in another, never share a name */
+	if (snprintf(tmp, sizeof(tmp), "%s.%s.%d.tmp", fn, playbg_shm_token, ast_atomic_fetchadd_int(&playbg_shm_seq, 1)) >= sizeof(tmp)) {
+		ast_free(header);
+		return -1;
+	}
+	if ((fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW, 0600)) < 0) {
+		playbg_diag(__LOG_WARNING, PLAYBG_CNT_SHM_INVALID, "Unable to create '%s': %s", tmp, strerror(errno));
+		ast_free(header);
+		return -1;
+	}
+	if (write(fd, header, PLAYBG_SHM_HEADER) == PLAYBG_SHM_HEADER
+	    && write(fd, audio->data, size - PLAYBG_SHM_HEADER) == (ssize_t) (size - PLAYBG_SHM_HEADER))
+		res = 0;
+	close(fd);
+	ast_free(header);
+	if (res || rename(tmp, fn)) {
+		playbg_diag(__LOG_WARNING, PLAYBG_CNT_SHM_INVALID, "Unable to publish '%s' as '%s': %s", path, fn, strerror(errno));
+		unlink(tmp);
+		return -1;
+	}
+	playbg_count(PLAYBG_CNT_SHM_PUBLISHED);
+
+	/* map it back like any other instance would, and drop our copy */
+	if (!(mapped = playbg_shm_attach(audio->name, audio->language, audio->rate, audio->normalized, path, src)))
+		return -1;
+	ast_free(audio->data);
+	audio->data = mapped->data;
+	audio->shm = mapped->shm;
+	audio->shmsize = mapped->shmsize;
+	mapped->shm = NULL;
+	mapped->data = NULL;
+	playbg_audio_free(mapped);
+	return 0;
+}
+
+
+/*! \brief Decode a file to signed linear at its own rate, then bring it to \a rate */
+static struct playbg_audio *playbg_audio_decode(const char *name, const char *language, int rate, int normalize)
+{
+	struct playbg_resolved res;
+	struct playbg_audio *audio;
+	struct ast_filestream *fs;
+	struct ast_trans_pvt *trans = NULL;
+	struct ast_frame *f, *out;
+	short *data = NULL, *tmp;
+	char path[PATH_MAX + 64];
+	struct stat st;
+	int srcrate, slin, n, samples = 0, size = 0, max, shared;
+
+	if (playbg_resolve_cached(name, language, 0, &res)) {
+		playbg_failure(name, language);
+		return NULL;
+	}
+	playbg_resolved_file(&res, path, sizeof(path));
+	if (stat(path, &st))
+		memset(&st, 0, sizeof(st));
+	shared = playbg_shared_cache && st.st_mtime;
+	if (shared && (audio = playbg_shm_attach(name, language, rate, normalize, path, &st))) {
+		playbg_audio_source(audio, path, st.st_mtime, st.st_size);
+		playbg_count(PLAYBG_CNT_SHM_HITS);
+		if (option_verbose > 2)
+			ast_verbose(VERBOSE_PREFIX_3 "Mapped '%s' at %d Hz from the shared cache\n", path, rate);
+		return audio;
+	}
+	if (!(fs = ast_readfile(res.path, res.ext, NULL, O_RDONLY, 0, 0))) {
+		playbg_failure(name, language);
+		return NULL;
+	}
+
+	srcrate = playbg_format_rate(fs->fmt->format);
+	if (!(slin = playbg_slin_format(srcrate))
+		|| (fs->fmt->format != slin && !(trans = ast_translator_build_path(slin, fs->fmt->format)))) {
+		playbg_diag(__LOG_NOTICE, PLAYBG_CNT_UNCACHEABLE, "Cannot decode '%s.%s' for caching, playing it from disk", res.path, res.ext);
+		ast_closestream(fs);
+		return NULL;
+	}
+
+	max = playbg_cache_maxfile * srcrate;
+	if (!ast_seekstream(fs, 0, SEEK_END) && ast_tellstream(fs) > max) {
+		if (option_debug)
+			ast_log(LOG_DEBUG, "'%s' is too long to be cached\n", name);
+		ast_closestream(fs);
+		if (trans)
+			ast_translator_free_path(trans);
+		return NULL;
+	}
+	ast_seekstream(fs, 0, SEEK_SET);
+
+	while ((f = ast_readframe(fs))) {
+		if (!(out = trans ? ast_translate(trans, f, 0) : f))
+			continue;
+		n = out->datalen / sizeof(short);
+		if (samples + n > max) {
+			if (option_debug)
+				ast_log(LOG_DEBUG, "'%s' is too long to be cached\n", name);
+			samples = -1;
+			break;
+		}
+		if (samples + n > size) {
+			size = MAX(size * 2, samples + n + srcrate);
+			if (!(tmp = ast_realloc(data, size * sizeof(*data)))) {
+				samples = -1;
+				break;
+			}
+			data = tmp;
+		}
+		memcpy(data + samples, out->data, n * sizeof(*data));
+		samples += n;
+	}
+	if (trans)
+		ast_translator_free_path(trans);
+	ast_closestream(fs);
+
+	if (samples <= 0) {
+		if (data)
+			ast_free(data);
+		return NULL;
+	}
+
+	if (srcrate != rate) {
+		tmp = playbg_resample(data, samples, srcrate, rate, &samples);
+		ast_free(data);
+		if (!(data = tmp))
+			return NULL;
+	}
+
+	if (normalize)
+		playbg_normalize_audio(path, data, samples, rate);
+
+	if (!(audio = playbg_audio_new(name, language, rate, normalize, data, samples))) {
+		ast_free(data);
+		return NULL;
+	}
+	playbg_audio_source(audio, path, st.st_mtime, st.st_size);
+	if (!shared || playbg_shm_publish(audio, path, &st))
+		playbg_audio_place(audio);
+	if (option_verbose > 2)
+		ast_verbose(VERBOSE_PREFIX_3 "Cached '%s.%s' (%d Hz) as %d samples at %d Hz\n", res.path, res.ext, srcrate, samples, rate);
+	return audio;
+}
+
+
+/*! \brief Decode a bank member like playbg_audio_decode() does a file */
+static struct playbg_audio *playbg_bank_decode(const char *name, const char *language, int rate, int normalize)
+{
+	const struct playbg_bank_entry *entry;
+	struct playbg_bank *bank = NULL;
+	struct playbg_audio *audio;
+	const unsigned char *src;
+	short *data, *tmp;
+	char source[PATH_MAX];
+	time_t mtime;
+	off_t fsize;
+	int i, samples, srcrate;
+
+	if (!(entry = playbg_bank_find(name, language, &bank))) {
+		playbg_diag(__LOG_WARNING, PLAYBG_CNT_BANK_FAILED, "No member '%s' for language '%s'", name, language);
+		return NULL;
+	}
+	src = bank->map + entry->offset;
+	samples = playbg_bank_samples(entry);
+	if (samples <= 0 || samples > playbg_cache_maxfile * (int) entry->rate) {
+		if (option_debug)
+			ast_log(LOG_DEBUG, "'%s' is empty or too long to be cached\n", name);
+		playbg_bank_unref(bank);
+		return NULL;
+	}
+
+	if (entry->encoding == PLAYBG_BANK_SLIN && entry->rate == rate && !normalize && !(entry->offset % sizeof(short))) {
+		if ((audio = playbg_audio_new(name, language, rate, normalize, (short *) src, samples))) {
+			playbg_audio_source(audio, bank->path, bank->mtime, bank->size);
+			audio->bank = bank;
+		} else {
+			playbg_bank_unref(bank);
+		}
+		return audio;
+	}
+
+	if (!(data = ast_malloc(samples * sizeof(*data)))) {
+		playbg_bank_unref(bank);
+		return NULL;
+	}
+	switch (entry->encoding) {
+	case PLAYBG_BANK_ULAW:
+		for (i = 0; i < samples; i++)
+			data[i] = AST_MULAW(src[i]);
+		break;
+	case PLAYBG_BANK_ALAW:
+		for (i = 0; i < samples; i++)
+			data[i] = AST_ALAW(src[i]);
+		break;
+	default:
+		memcpy(data, src, samples * sizeof(*data));
+		break;
+	}
+	srcrate = entry->rate;
+	ast_copy_string(source, bank->path, sizeof(source));
+	mtime = bank->mtime;
+	fsize = bank->size;
+	playbg_bank_unref(bank);
+
+	if (srcrate != rate) {
+		tmp = playbg_resample(data, samples, srcrate, rate, &samples);
+		ast_free(data);
+		if (!(data = tmp))
+			return NULL;
+	}
+	/* nothing on disk to key astdb with, measured each time: clips are short */
+	if (normalize)
+		playbg_normalize_audio(name, data, samples, rate);
+	if (!(audio = playbg_audio_new(name, language, rate, normalize, data, samples))) {
+		ast_free(data);
+		return NULL;
+	}
+	playbg_audio_source(audio, source, mtime, fsize);
+	playbg_audio_place(audio);
+	return audio;
+}
+
+
+static struct playbg_audio *playbg_cache_find(const char *name, const char *language, int rate, int normalize, unsigned int hash)
+{
+	struct playbg_audio *audio;
+
+	AST_LIST_TRAVERSE(&playbg_cache[hash % PLAYBG_CACHE_BUCKETS], audio, list) {
+		if (audio->hash == hash && audio->rate == rate && audio->normalized == normalize
+		    && !strcmp(audio->name, name) && !strcmp(audio->language, language))
+			return audio;
+	}
+	return NULL;
+}
+
+
+/*! \brief Cache bytes an entry takes, none when it plays from a bank's map */
+static int64_t playbg_audio_bytes(const struct playbg_audio *audio)
+{
+	return audio->bank ? 0 : (int64_t) audio->samples * sizeof(short);
+}
+
+
+/* Cache builds */
+#define PLAYBG_BUILD_RETRY 300
+
+enum playbg_build_state {
+	PLAYBG_BUILD_QUEUED,
+	PLAYBG_BUILD_RUNNING,
+	PLAYBG_BUILD_FAILED,
+};
+
+struct playbg_build {
+	char *name;
+	char *language;
+	unsigned int hash;
+	int rate;
+	int normalize;
+	enum playbg_build_state state;
+	time_t failed;
+	AST_LIST_ENTRY(playbg_build) list;
+};
+
+static AST_LIST_HEAD_NOLOCK_STATIC(playbg_builds, playbg_build);
+static ast_cond_t playbg_build_cond;
+static pthread_t playbg_build_thread = AST_PTHREADT_NULL;
+static int playbg_build_stop;
+
+
+static void playbg_build_free(struct playbg_build *build)
+{
+	ast_free(build->name);
+	ast_free(build->language);
+	ast_free(build);
+}
+
+
+/*! \brief Find the build record of a key, called with playbg_cache_lock held */
+static struct playbg_build *playbg_build_find(const char *name, const char *language, int rate, int normalize, unsigned int hash)
+{
+	struct playbg_build *build;
+
+	AST_LIST_TRAVERSE(&playbg_builds, build, list) {
+		if (build->hash == hash && build->rate == rate && build->normalize == normalize
+		    && !strcmp(build->name, name) && !strcmp(build->language, language))
+			break;
+	}
+	return build;
+}
+
+
+/*! \brief Add a build record, called with playbg_cache_lock held */
+static struct playbg_build *playbg_build_new(const char *name, const char *language, int rate, int normalize, unsigned int hash, enum playbg_build_state state)
+{
+	struct playbg_build *build;
+
+	if (!(build = ast_calloc(1, sizeof(*build))))
+		return NULL;
+	if (!(build->name = ast_strdup(name)) || !(build->language = ast_strdup(language))) {
+		if (build->name)
+			ast_free(build->name);
+		ast_free(build);
+		return NULL;
+	}
+	build->hash = hash;
+	build->rate = rate;
+	build->normalize = normalize;
+	build->state = state;
+	AST_LIST_INSERT_TAIL(&playbg_builds, build, list);
+	return build;
+}
+
+
+/*! \brief Close the build of a key: forget it once cached, else remember the failure */
+static void playbg_build_done(const char *name, const char *language, int rate, int normalize, unsigned int hash, int cached)
+{
+	struct playbg_build *build;
+
+	if (!(build = playbg_build_find(name, language, rate, normalize, hash)))
+		return;
+	if (cached) {
+		AST_LIST_REMOVE(&playbg_builds, build, list);
+		playbg_build_free(build);
+	} else {
+		build->state = PLAYBG_BUILD_FAILED;
+		build->failed = time(NULL);
+	}
+}
+
+
+/*! \brief Forget failed builds, so the next lookup tries again */
+static void playbg_build_flush(void)
+{
+	struct playbg_build *build;
+
+	ast_mutex_lock(&playbg_cache_lock);
+	AST_LIST_TRAVERSE_SAFE_BEGIN(&playbg_builds, build, list) {
+		if (build->state == PLAYBG_BUILD_FAILED) {
+			AST_LIST_REMOVE_CURRENT(&playbg_builds, list);
+			playbg_build_free(build);
+		}
+	}
+	AST_LIST_TRAVERSE_SAFE_END
+	ast_mutex_unlock(&playbg_cache_lock);
+}
+
+
+/*! \brief Decode a file into the cache, its build record claimed by the caller */
+static struct playbg_audio *playbg_cache_build(const char *name, const char *language, int rate, int normalize, unsigned int hash)
+{
+	struct playbg_audio *audio, *found;
+	int bank = !strncmp(name, "bank:", 5);
+
+	if (!(audio = bank ? playbg_bank_decode(name, language, rate, normalize) : playbg_audio_decode(name, language, rate, normalize))) {
+		if (bank)
+			playbg_failure(name, language);
+		ast_mutex_lock(&playbg_cache_lock);
+		playbg_build_done(name, language, rate, normalize, hash, 0);
+		ast_mutex_unlock(&playbg_cache_lock);
+		return NULL;
+	}
+	playbg_failure_clear(name, language);
+
+	ast_mutex_lock(&playbg_cache_lock);
+	if ((found = playbg_cache_find(name, language, rate, normalize, hash))) {
+		playbg_audio_ref(found);
+	} else if (playbg_cache_enabled && playbg_cache_bytes + playbg_audio_bytes(audio) <= playbg_cache_size) {
+		playbg_cache_bytes += playbg_audio_bytes(audio);
+		AST_LIST_INSERT_HEAD(&playbg_cache[hash % PLAYBG_CACHE_BUCKETS], audio, list);
+		found = playbg_audio_ref(audio);
+		audio = NULL;
+	} else if (bank) {
+		found = audio;
+		audio = NULL;
+	}
+	/* a bank member decoded for the caller alone is tried again next time */
+	playbg_build_done(name, language, rate, normalize, hash, found != NULL);
+	ast_mutex_unlock(&playbg_cache_lock);
+
+	if (audio) {
+		if (!found && option_verbose > 2)
+			ast_verbose(VERBOSE_PREFIX_3 "PlayBG cache full, playing '%s' from disk\n", name);
+		playbg_audio_unref(audio);
+	}
+	return found;
+}
+
+
+/*! \brief Get cached audio for a file, decoding it now if need be */
+static struct playbg_audio *playbg_cache_get(const char *name, const char *language, int rate, int normalize)
+{
+	unsigned int hash = playbg_hash(name, language, rate);
+	struct playbg_audio *audio;
+	struct playbg_build *build;
+	int bank = !strncmp(name, "bank:", 5);
+	int skip = 0;
+
+	if (ast_strlen_zero(name))
+		return NULL;
+	if (!bank && (!playbg_cache_enabled || playbg_cache_bytes >= playbg_cache_size))
+		return NULL;
+	if (playbg_failed_recently(name, language))
+		return NULL;
+
+	ast_mutex_lock(&playbg_cache_lock);
+	if ((audio = playbg_cache_find(name, language, rate, normalize, hash)))
+		playbg_audio_ref(audio);
+	else if ((build = playbg_build_find(name, language, rate, normalize, hash))) {
+		if (build->state == PLAYBG_BUILD_RUNNING
+		    || (build->state == PLAYBG_BUILD_FAILED && time(NULL) - build->failed < PLAYBG_BUILD_RETRY))
+			skip = 1;
+		else
+			build->state = PLAYBG_BUILD_RUNNING;
+	} else
+		playbg_build_new(name, language, rate, normalize, hash, PLAYBG_BUILD_RUNNING);
+	ast_mutex_unlock(&playbg_cache_lock);
+	if (audio || skip)
+		return audio;
+
+	return playbg_cache_build(name, language, rate, normalize, hash);
+}
+
+
+/*! \brief Get cached audio for a file without waiting for it */
+static struct playbg_audio *playbg_cache_lookup(const char *name, const char *language, int rate, int normalize)
+{
+	unsigned int hash = playbg_hash(name, language, rate);
+	struct playbg_audio *audio;
+	struct playbg_build *build;
+
+	if (!strncmp(name, "bank:", 5))
+		return playbg_cache_get(name, language, rate, normalize);
+	if (ast_strlen_zero(name) || !playbg_cache_enabled || playbg_cache_bytes >= playbg_cache_size)
+		return NULL;
+	if (playbg_build_thread == AST_PTHREADT_NULL || playbg_failed_recently(name, language))
+		return NULL;
+
+	ast_mutex_lock(&playbg_cache_lock);
+	if ((audio = playbg_cache_find(name, language, rate, normalize, hash))) {
+		playbg_audio_ref(audio);
+	} else if (!(build = playbg_build_find(name, language, rate, normalize, hash))) {
+		if (playbg_build_new(name, language, rate, normalize, hash, PLAYBG_BUILD_QUEUED))
+			ast_cond_signal(&playbg_build_cond);
+	} else if (build->state == PLAYBG_BUILD_FAILED && time(NULL) - build->failed >= PLAYBG_BUILD_RETRY) {
+		build->state = PLAYBG_BUILD_QUEUED;
+		ast_cond_signal(&playbg_build_cond);
+	}
+	ast_mutex_unlock(&playbg_cache_lock);
+	return audio;
+}
+
+
+static void *playbg_build_run(void *data)
+{
+	char name[PATH_MAX], language[MAX_LANGUAGE];
+	struct playbg_build *build;
+	int rate, normalize;
+	unsigned int hash;
+
+	ast_mutex_lock(&playbg_cache_lock);
+	while (!playbg_build_stop) {
+		AST_LIST_TRAVERSE(&playbg_builds, build, list) {
+			if (build->state == PLAYBG_BUILD_QUEUED)
+				break;
+		}
+		if (!build) {
+			ast_cond_wait(&playbg_build_cond, &playbg_cache_lock);
+			continue;
+		}
+		build->state = PLAYBG_BUILD_RUNNING;
+		ast_copy_string(name, build->name, sizeof(name));
+		ast_copy_string(language, build->language, sizeof(language));
+		rate = build->rate;
+		normalize = build->normalize;
+		hash = build->hash;
+		ast_mutex_unlock(&playbg_cache_lock);
+
+		playbg_audio_unref(playbg_cache_build(name, language, rate, normalize, hash));
+
+		ast_mutex_lock(&playbg_cache_lock);
+	}
+	ast_mutex_unlock(&playbg_cache_lock);
+	return NULL;
+}
+
+
+static void playbg_build_start(void)
+{
+	if (playbg_build_thread != AST_PTHREADT_NULL)
+		return;
+	playbg_build_stop = 0;
+	ast_cond_init(&playbg_build_cond, NULL);
+	if (ast_pthread_create_background(&playbg_build_thread, NULL, playbg_build_run, NULL)) {
+		ast_log(LOG_WARNING, "Unable to start playbg cache build thread, files play from disk\n");
+		playbg_build_thread = AST_PTHREADT_NULL;
+		ast_cond_destroy(&playbg_build_cond);
+	}
+}
+
+
+/*! \brief Stop the thread after the build in progress, and forget all records */
+static void playbg_build_shutdown(void)
+{
+	struct playbg_build *build;
+
+	if (playbg_build_thread != AST_PTHREADT_NULL) {
+		ast_mutex_lock(&playbg_cache_lock);
+		playbg_build_stop = 1;
+		ast_cond_signal(&playbg_build_cond);
+		ast_mutex_unlock(&playbg_cache_lock);
+		pthread_join(playbg_build_thread, NULL);
+		playbg_build_thread = AST_PTHREADT_NULL;
+		ast_cond_destroy(&playbg_build_cond);
+	}
+	ast_mutex_lock(&playbg_cache_lock);
+	while ((build = AST_LIST_REMOVE_HEAD(&playbg_builds, list)))
+		playbg_build_free(build);
+	ast_mutex_unlock(&playbg_cache_lock);
+}
+
+
+static void playbg_cache_purge(void)
+{
+	struct playbg_audio *audio;
+	int i;
+
+	ast_mutex_lock(&playbg_cache_lock);
+	for (i = 0; i < PLAYBG_CACHE_BUCKETS; i++) {
+		while ((audio = AST_LIST_REMOVE_HEAD(&playbg_cache[i], list)))
+			playbg_audio_unref(audio);
+	}
+	playbg_cache_bytes = 0;
+	ast_mutex_unlock(&playbg_cache_lock);
+}
+
+
+/*! \brief Whether a file of a playlist is better played from the cache */
+static int playbg_state_cacheable(struct playbg_state *state, struct ast_channel *chan, int pos)
+{
+	struct playbg_resolved res;
+	const char *name = state->filearray[pos];
+
+	if (!name || state->dtx || state->trim || state->normalize || !strncmp(name, "bank:", 5))
+		return 1;
+	if (playbg_resolve_cached(name, chan->language, chan->nativeformats, &res))
+		return 1;
+	return !(res.format & chan->nativeformats) || res.format == playbg_slin_format(state->chanrate);
+}
+
+
+/*! \brief Attach cached audio for the files of a playlist at the channel rate */
+static void playbg_state_cache(struct playbg_state *state, struct ast_channel *chan)
+{
+	int rate = playbg_chan_rate(chan);
+	int i;
+
+	if (state->chanrate == rate)
+		return;
+	state->chanrate = rate;
+	state->src = NULL;
+	for (i = 0; i < state->nfiles; i++) {
+		playbg_audio_unref(state->audio[i]);
+		state->audio[i] = NULL;
+		if (playbg_state_cacheable(state, chan, i))
+			state->audio[i] = playbg_cache_lookup(state->filearray[i], chan->language, rate, state->normalize);
+	}
+}
+
+
+/*! \brief Whether the source of cached audio is not what it was decoded from */
+static int playbg_audio_changed(const struct playbg_audio *audio)
+{
+	struct playbg_resolved res;
+	char path[PATH_MAX + 64];
+	const char *member;
+	struct stat st;
+
+	if (!strncmp(audio->name, "bank:", 5)) {
+		if (!(member = strchr(audio->name + 5, '/')))
+			return 1;
+		snprintf(path, sizeof(path), "%s/sounds/%.*s%s", ast_config_AST_DATA_DIR, (int) (member - audio->name - 5), audio->name + 5, PLAYBG_BANK_EXT);
+	} else if (playbg_resolve(audio->name, audio->language, 0, &res)) {
+		return 1;
+	} else {
+		playbg_resolved_file(&res, path, sizeof(path));
+	}
+	if (stat(path, &st))
+		return 1;
+	return !audio->source || strcmp(audio->source, path) || st.st_mtime != audio->mtime || st.st_size != audio->size;
+}
+
+
+/*! \brief Put new audio in the place of old in the cache */
+static int playbg_cache_swap(struct playbg_audio *old, struct playbg_audio *fresh)
+{
+	struct playbg_bucket *bucket = &playbg_cache[old->hash % PLAYBG_CACHE_BUCKETS];
+	struct playbg_audio *audio;
+	int res = 0;
+
+	ast_mutex_lock(&playbg_cache_lock);
+	AST_LIST_TRAVERSE_SAFE_BEGIN(bucket, audio, list) {
+		if (audio == old) {
+			if (fresh && playbg_cache_bytes - playbg_audio_bytes(old) + playbg_audio_bytes(fresh) > playbg_cache_size)
+				fresh = NULL;
+			if (!fresh) {
+				res = 1;
+			} else {
+				AST_LIST_INSERT_HEAD(bucket, fresh, list);
+				playbg_cache_bytes += playbg_audio_bytes(fresh);
+			}
+			AST_LIST_REMOVE_CURRENT(bucket, list);
+			playbg_cache_bytes -= playbg_audio_bytes(old);
+			break;
+		}
+	}
+	AST_LIST_TRAVERSE_SAFE_END;
+	ast_mutex_unlock(&playbg_cache_lock);
+	if (audio != old)
+		return -1;
+	old->stale = 1;
+	playbg_audio_unref(old);	/* the cache's */
+	return res;
+}
+
+#endif /* _PLAYBG_CACHE_H */
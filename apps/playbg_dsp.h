@@ -0,0 +1,510 @@
+/*
+ * See http://www.asterisk.org for more information about
+ * the Asterisk project. Please do not directly contact
+ * any of the maintainers of this project for assistance;
+ * the project provides a web site, mailing lists and IRC
+ * channels for your use.
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+*/
+
+/*! \file
+ *
+ * \brief Signal processing of app_playbg: kernels, resampling, loudness
+ */
+
+#ifndef _PLAYBG_DSP_H
+#define _PLAYBG_DSP_H
+
+/* gains are Q12 fixed point, 4096 is unity */
+#define PLAYBG_GAIN_SHIFT 12
+#define PLAYBG_GAIN_UNITY (1 << PLAYBG_GAIN_SHIFT)
+
+
+/* Audio kernels */
+struct playbg_dsp {
+	const char *name;
+	/*! Apply a Q12 gain in place, saturating to 16 bits */
+	void (*gain)(short *buf, int n, int gain);
+	/*! Exact 64 bit dot product, used for FIR filtering and energy */
+	int64_t (*dot)(const short *a, const short *b, int n);
+};
+
+
+static void playbg_gain_scalar(short *buf, int n, int gain)
+{
+	int i, v;
+
+	for (i = 0; i < n; i++) {
+		v = (buf[i] * gain + (1 << (PLAYBG_GAIN_SHIFT - 1))) >> PLAYBG_GAIN_SHIFT;
+		if (v > 32767)
+			v = 32767;
+		else if (v < -32768)
+			v = -32768;
+		buf[i] = v;
+	}
+}
+
+
+static int64_t playbg_dot_scalar(const short *a, const short *b, int n)
+{
+	int64_t acc = 0;
+	int i;
+
+	for (i = 0; i < n; i++)
+		acc += a[i] * b[i];
+	return acc;
+}
+
+
+#if defined(__x86_64__) || defined(__i386__)
+
+__attribute__((target("sse2")))
+static void playbg_gain_sse2(short *buf, int n, int gain)
+{
+	const __m128i g = _mm_set1_epi16(gain);
+	const __m128i round = _mm_set1_epi32(1 << (PLAYBG_GAIN_SHIFT - 1));
+	__m128i x, lo, hi, p0, p1;
+	int i;
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		x = _mm_loadu_si128((const __m128i *) (buf + i));
+		lo = _mm_mullo_epi16(x, g);
+		hi = _mm_mulhi_epi16(x, g);
+		p0 = _mm_srai_epi32(_mm_add_epi32(_mm_unpacklo_epi16(lo, hi), round), PLAYBG_GAIN_SHIFT);
+		p1 = _mm_srai_epi32(_mm_add_epi32(_mm_unpackhi_epi16(lo, hi), round), PLAYBG_GAIN_SHIFT);
+		_mm_storeu_si128((__m128i *) (buf + i), _mm_packs_epi32(p0, p1));
+	}
+	playbg_gain_scalar(buf + i, n - i, gain);
+}
+
+
+__attribute__((target("sse2")))
+static int64_t playbg_dot_sse2(const short *a, const short *b, int n)
+{
+	__m128i acc = _mm_setzero_si128();
+	__m128i x, y, lo, hi, p;
+	int64_t lanes[2];
+	int i;
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		x = _mm_loadu_si128((const __m128i *) (a + i));
+		y = _mm_loadu_si128((const __m128i *) (b + i));
+		lo = _mm_mullo_epi16(x, y);
+		hi = _mm_mulhi_epi16(x, y);
+		/* widen each 32 bit product to 64 bits before summing, -32768^2 pairs overflow */
+		p = _mm_unpacklo_epi16(lo, hi);
+		acc = _mm_add_epi64(acc, _mm_unpacklo_epi32(p, _mm_srai_epi32(p, 31)));
+		acc = _mm_add_epi64(acc, _mm_unpackhi_epi32(p, _mm_srai_epi32(p, 31)));
+		p = _mm_unpackhi_epi16(lo, hi);
+		acc = _mm_add_epi64(acc, _mm_unpacklo_epi32(p, _mm_srai_epi32(p, 31)));
+		acc = _mm_add_epi64(acc, _mm_unpackhi_epi32(p, _mm_srai_epi32(p, 31)));
+	}
+	_mm_storeu_si128((__m128i *) lanes, acc);
+	return lanes[0] + lanes[1] + playbg_dot_scalar(a + i, b + i, n - i);
+}
+
+
+__attribute__((target("avx2")))
+static void playbg_gain_avx2(short *buf, int n, int gain)
+{
+	const __m256i g = _mm256_set1_epi16(gain);
+	const __m256i round = _mm256_set1_epi32(1 << (PLAYBG_GAIN_SHIFT - 1));
+	__m256i x, lo, hi, p0, p1;
+	int i;
+
+	/* unpack and pack both work per 128 bit lane, so sample order is kept */
+	for (i = 0; i + 16 <= n; i += 16) {
+		x = _mm256_loadu_si256((const __m256i *) (buf + i));
+		lo = _mm256_mullo_epi16(x, g);
+		hi = _mm256_mulhi_epi16(x, g);
+		p0 = _mm256_srai_epi32(_mm256_add_epi32(_mm256_unpacklo_epi16(lo, hi), round), PLAYBG_GAIN_SHIFT);
+		p1 = _mm256_srai_epi32(_mm256_add_epi32(_mm256_unpackhi_epi16(lo, hi), round), PLAYBG_GAIN_SHIFT);
+		_mm256_storeu_si256((__m256i *) (buf + i), _mm256_packs_epi32(p0, p1));
+	}
+	playbg_gain_scalar(buf + i, n - i, gain);
+}
+
+
+__attribute__((target("avx2")))
+static int64_t playbg_dot_avx2(const short *a, const short *b, int n)
+{
+	__m256i acc = _mm256_setzero_si256();
+	__m256i p;
+	int64_t lanes[4];
+	int i;
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		p = _mm256_mullo_epi32(_mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i *) (a + i))),
+			_mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i *) (b + i))));
+		acc = _mm256_add_epi64(acc, _mm256_cvtepi32_epi64(_mm256_castsi256_si128(p)));
+		acc = _mm256_add_epi64(acc, _mm256_cvtepi32_epi64(_mm256_extracti128_si256(p, 1)));
+	}
+	_mm256_storeu_si256((__m256i *) lanes, acc);
+	return lanes[0] + lanes[1] + lanes[2] + lanes[3] + playbg_dot_scalar(a + i, b + i, n - i);
+}
+
+#elif defined(__aarch64__)
+
+static void playbg_gain_neon(short *buf, int n, int gain)
+{
+	const int16x4_t g = vdup_n_s16(gain);
+	const int32x4_t round = vdupq_n_s32(1 << (PLAYBG_GAIN_SHIFT - 1));
+	int16x8_t x;
+	int32x4_t p0, p1;
+	int i;
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		x = vld1q_s16(buf + i);
+		p0 = vshrq_n_s32(vaddq_s32(vmull_s16(vget_low_s16(x), g), round), PLAYBG_GAIN_SHIFT);
+		p1 = vshrq_n_s32(vaddq_s32(vmull_s16(vget_high_s16(x), g), round), PLAYBG_GAIN_SHIFT);
+		vst1q_s16(buf + i, vcombine_s16(vqmovn_s32(p0), vqmovn_s32(p1)));
+	}
+	playbg_gain_scalar(buf + i, n - i, gain);
+}
+
+
+static int64_t playbg_dot_neon(const short *a, const short *b, int n)
+{
+	int64x2_t acc = vdupq_n_s64(0);
+	int16x8_t x, y;
+	int i;
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		x = vld1q_s16(a + i);
+		y = vld1q_s16(b + i);
+		acc = vpadalq_s32(acc, vmull_s16(vget_low_s16(x), vget_low_s16(y)));
+		acc = vpadalq_s32(acc, vmull_s16(vget_high_s16(x), vget_high_s16(y)));
+	}
+	return vgetq_lane_s64(acc, 0) + vgetq_lane_s64(acc, 1) + playbg_dot_scalar(a + i, b + i, n - i);
+}
+
+#endif
+
+
+static int playbg_cpu_has(const char *feature)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if (!strcmp(feature, "sse2"))
+		return __builtin_cpu_supports("sse2");
+	if (!strcmp(feature, "avx2"))
+		return __builtin_cpu_supports("avx2");
+#elif defined(__aarch64__)
+	if (!strcmp(feature, "neon"))
+		return (getauxval(AT_HWCAP) & HWCAP_ASIMD) ? 1 : 0;
+#endif
+	return !strcmp(feature, "scalar");
+}
+
+
+/* best first, scalar must stay last */
+static const struct playbg_dsp playbg_dsp_variants[] = {
+#if defined(__x86_64__) || defined(__i386__)
+	{ "avx2", playbg_gain_avx2, playbg_dot_avx2 },
+	{ "sse2", playbg_gain_sse2, playbg_dot_sse2 },
+#elif defined(__aarch64__)
+	{ "neon", playbg_gain_neon, playbg_dot_neon },
+#endif
+	{ "scalar", playbg_gain_scalar, playbg_dot_scalar },
+};
+
+#define PLAYBG_DSP_SCALAR (&playbg_dsp_variants[ARRAY_LEN(playbg_dsp_variants) - 1])
+
+static const struct playbg_dsp *playbg_dsp = PLAYBG_DSP_SCALAR;
+
+
+/*! \brief Check a kernel variant against the scalar one, returns 0 if bit identical */
+static int playbg_dsp_selftest(const struct playbg_dsp *dsp)
+{
+	static const int gains[] = { 0, 1, PLAYBG_GAIN_UNITY - 1, PLAYBG_GAIN_UNITY, 12345, 32767 };
+	short a[515], b[515], ref[515], out[515];
+	unsigned int seed = 0x5eed;
+	int i, g, n;
+
+	for (i = 0; i < ARRAY_LEN(a); i++) {
+		seed = seed * 1103515245 + 12345;
+		a[i] = seed >> 16;
+		seed = seed * 1103515245 + 12345;
+		b[i] = seed >> 16;
+	}
+	/* make sure the saturation and widening corner cases are covered */
+	for (i = 0; i < 32; i++) {
+		a[i] = b[i] = -32768;
+		a[i + 32] = b[i + 32] = 32767;
+	}
+
+	for (n = 0; n <= ARRAY_LEN(a); n += (n < 40) ? 1 : 79) {
+		if (dsp->dot(a, b, n) != playbg_dot_scalar(a, b, n) || dsp->dot(a, a, n) != playbg_dot_scalar(a, a, n))
+			return -1;
+		for (g = 0; g < ARRAY_LEN(gains); g++) {
+			memcpy(ref, a, sizeof(ref));
+			memcpy(out, a, sizeof(out));
+			playbg_gain_scalar(ref, n, gains[g]);
+			dsp->gain(out, n, gains[g]);
+			if (memcmp(ref, out, sizeof(ref)))
+				return -1;
+		}
+	}
+	return 0;
+}
+
+
+static void playbg_dsp_init(void)
+{
+	const struct playbg_dsp *dsp;
+	int i;
+
+	playbg_dsp = PLAYBG_DSP_SCALAR;
+	for (i = 0; i < ARRAY_LEN(playbg_dsp_variants); i++) {
+		dsp = &playbg_dsp_variants[i];
+		if (!playbg_cpu_has(dsp->name))
+			continue;
+		if (playbg_dsp_selftest(dsp)) {
+			ast_log(LOG_ERROR, "%s audio kernels failed self-test, not using them\n", dsp->name);
+			continue;
+		}
+		playbg_dsp = dsp;
+		break;
+	}
+	if (option_verbose > 1)
+		ast_verbose(VERBOSE_PREFIX_2 "PlayBG using %s audio kernels\n", playbg_dsp->name);
+}
+
+
+/* Polyphase resampler */
+#define PLAYBG_RESAMPLE_TAPS 24		/* taps per phase when not decimating */
+#define PLAYBG_RESAMPLE_MAX_PHASES 4096
+
+static int playbg_gcd(int a, int b)
+{
+	int t;
+
+	while (b) {
+		t = a % b;
+		a = b;
+		b = t;
+	}
+	return a;
+}
+
+
+static short *playbg_resample(const short *in, int nin, int from, int to, int *nout)
+{
+	int g = playbg_gcd(from, to);
+	int up = to / g, down = from / g;
+	double cutoff = 0.9 * MIN(1.0, (double) up / down);
+	double *h, u, w, sum;
+	short *coef = NULL, *pad = NULL, *out = NULL;
+	int taps, half, p, k, n, count;
+	int64_t acc, pos;
+
+	if (up > PLAYBG_RESAMPLE_MAX_PHASES) {
+		ast_log(LOG_WARNING, "Unsupported resampling ratio %d:%d\n", from, to);
+		return NULL;
+	}
+
+	taps = (int) ceil(PLAYBG_RESAMPLE_TAPS / cutoff);
+	taps = (taps + 7) & ~7;
+	half = taps / 2;
+	count = (int) ((int64_t) nin * up / down);
+
+	if (!(h = ast_calloc(taps, sizeof(*h))) || !(coef = ast_calloc(up * taps, sizeof(*coef)))
+		|| !(pad = ast_calloc(nin + 2 * taps, sizeof(*pad))) || !(out = ast_calloc(count + 1, sizeof(*out)))) {
+		goto done;
+	}
+
+	/* phase p holds the taps for an output sitting p/up samples after an input one */
+	for (p = 0; p < up; p++) {
+		sum = 0;
+		for (k = 0; k < taps; k++) {
+			u = (double) p / up + half - 1 - k;
+			w = 0.42 + 0.5 * cos(M_PI * u / half) + 0.08 * cos(2 * M_PI * u / half);
+			h[k] = (u == 0) ? cutoff : sin(M_PI * cutoff * u) / (M_PI * u);
+			h[k] *= (fabs(u) < half) ? w : 0;
+			sum += h[k];
+		}
+		/* unity gain at DC for every phase */
+		for (k = 0; k < taps; k++)
+			coef[p * taps + k] = (short) lrint(h[k] / sum * 32767);
+	}
+
+	memcpy(pad + taps, in, nin * sizeof(*in));
+	for (n = 0; n < count; n++) {
+		pos = (int64_t) n * down;
+		acc = playbg_dsp->dot(pad + taps + pos / up - half + 1, coef + (pos % up) * taps, taps);
+		acc = (acc + (1 << 14)) >> 15;
+		out[n] = (acc > 32767) ? 32767 : (acc < -32768) ? -32768 : acc;
+	}
+	*nout = count;
+
+done:
+	if (h)
+		ast_free(h);
+	if (coef)
+		ast_free(coef);
+	if (pad)
+		ast_free(pad);
+	if (!coef || !pad) {
+		if (out)
+			ast_free(out);
+		out = NULL;
+	}
+	return out;
+}
+
+
+/* Loudness, ITU-R BS.1770 / EBU R128 */
+#define PLAYBG_LOUDNESS_FAMILY "playbg/loudness"
+#define PLAYBG_LOUDNESS_NONE -HUGE_VAL
+
+struct playbg_biquad {
+	double b0, b1, b2, a1, a2;
+	double z1, z2;
+};
+
+
+static void playbg_kweighting(struct playbg_biquad *shelf, struct playbg_biquad *hp, int rate)
+{
+	double k, q, vh, vb, a0;
+
+	/* stage 1: +4 dB high shelf around 1.7 kHz */
+	k = tan(M_PI * 1681.974450955533 / rate);
+	q = 0.7071752369554196;
+	vh = pow(10.0, 3.999843853973347 / 20);
+	vb = pow(vh, 0.4996667741545416);
+	a0 = 1 + k / q + k * k;
+	memset(shelf, 0, sizeof(*shelf));
+	shelf->b0 = (vh + vb * k / q + k * k) / a0;
+	shelf->b1 = 2 * (k * k - vh) / a0;
+	shelf->b2 = (vh - vb * k / q + k * k) / a0;
+	shelf->a1 = 2 * (k * k - 1) / a0;
+	shelf->a2 = (1 - k / q + k * k) / a0;
+
+	/* stage 2: high pass at 38 Hz */
+	k = tan(M_PI * 38.13547087602444 / rate);
+	q = 0.5003270373238773;
+	a0 = 1 + k / q + k * k;
+	memset(hp, 0, sizeof(*hp));
+	hp->b0 = 1;
+	hp->b1 = -2;
+	hp->b2 = 1;
+	hp->a1 = 2 * (k * k - 1) / a0;
+	hp->a2 = (1 - k / q + k * k) / a0;
+}
+
+
+static inline double playbg_biquad_run(struct playbg_biquad *f, double x)
+{
+	double y = f->b0 * x + f->z1;
+
+	f->z1 = f->b1 * x - f->a1 * y + f->z2;
+	f->z2 = f->b2 * x - f->a2 * y;
+	return y;
+}
+
+
+/*! \brief Integrated loudness in LUFS, PLAYBG_LOUDNESS_NONE if all of it is gated out */
+static double playbg_loudness_measure(const short *data, int samples, int rate)
+{
+	struct playbg_biquad shelf, hp;
+	int step = rate / 10;
+	int nsteps = (samples + step - 1) / step;
+	int nblocks = MAX(nsteps - 3, 1);
+	double *power, *blocks, x, sum, gate;
+	int i, j, n;
+
+	if (samples <= 0 || !(power = ast_calloc(nsteps + 3, sizeof(*power))))
+		return PLAYBG_LOUDNESS_NONE;
+	if (!(blocks = ast_calloc(nblocks, sizeof(*blocks)))) {
+		ast_free(power);
+		return PLAYBG_LOUDNESS_NONE;
+	}
+
+	playbg_kweighting(&shelf, &hp, rate);
+	for (i = 0; i < samples; i++) {
+		x = playbg_biquad_run(&hp, playbg_biquad_run(&shelf, data[i] / 32768.0));
+		power[i / step] += x * x;
+	}
+
+	/* 400 ms blocks overlapping by 75%, a short file is one block */
+	for (i = 0; i < nblocks; i++) {
+		n = MIN(4 * step, samples - i * step);
+		for (j = 0, sum = 0; j < 4; j++)
+			sum += power[i + j];
+		blocks[i] = sum / n;
+	}
+
+	gate = pow(10.0, (-70 + 0.691) / 10);
+	for (i = 0, n = 0, sum = 0; i < nblocks; i++) {
+		if (blocks[i] > gate) {
+			sum += blocks[i];
+			n++;
+		}
+	}
+	if (n) {
+		/* relative gate, 10 LU below the absolute gated loudness */
+		gate = MAX(gate, sum / n / 10);
+		for (i = 0, n = 0, sum = 0; i < nblocks; i++) {
+			if (blocks[i] > gate) {
+				sum += blocks[i];
+				n++;
+			}
+		}
+	}
+	ast_free(blocks);
+	ast_free(power);
+
+	return n ? -0.691 + 10 * log10(sum / n) : PLAYBG_LOUDNESS_NONE;
+}
+
+
+/*! \brief Loudness of a file, from astdb or measured on its decoded audio */
+static double playbg_loudness(const char *path, const short *data, int samples, int rate)
+{
+	struct stat st;
+	char buf[128];
+	long long mtime, size;
+	double lufs;
+
+	if (stat(path, &st)) {
+		memset(&st, 0, sizeof(st));
+	} else if (!ast_db_get(PLAYBG_LOUDNESS_FAMILY, path, buf, sizeof(buf))
+		   && sscanf(buf, "%lld:%lld:%lf", &mtime, &size, &lufs) == 3
+		   && mtime == (long long) st.st_mtime && size == (long long) st.st_size) {
+		return lufs;
+	}
+
+	lufs = playbg_loudness_measure(data, samples, rate);
+	if (st.st_mtime && lufs != PLAYBG_LOUDNESS_NONE) {
+		snprintf(buf, sizeof(buf), "%lld:%lld:%.2f", (long long) st.st_mtime, (long long) st.st_size, lufs);
+		ast_db_put(PLAYBG_LOUDNESS_FAMILY, path, buf);
+	}
+	if (option_debug)
+		ast_log(LOG_DEBUG, "Loudness of '%s' is %.2f LUFS\n", path, lufs);
+	return lufs;
+}
+
+
+/*! \brief Bring cached audio to the loudness target, through the gain kernel */
+static void playbg_normalize_audio(const char *path, short *data, int samples, int rate)
+{
+	double lufs = playbg_loudness(path, data, samples, rate);
+	double gain;
+	int i, peak = 1;
+
+	if (lufs == PLAYBG_LOUDNESS_NONE)
+		return;
+	for (i = 0; i < samples; i++)
+		peak = MAX(peak, abs(data[i]));
+	gain = MIN(pow(10.0, (playbg_loudness_target - lufs) / 20), 32767.0 / peak);
+	/* the kernels take 16 bit Q12 gains, just under 8x (+18 dB) */
+	gain = MIN(gain, 32767.0 / PLAYBG_GAIN_UNITY);
+	playbg_dsp->gain(data, samples, (int) lrint(gain * PLAYBG_GAIN_UNITY));
+	if (option_debug)
+		ast_log(LOG_DEBUG, "Normalized '%s' from %.2f LUFS with gain %.2f dB\n", path, lufs, 20 * log10(gain));
+}
+
+#endif /* _PLAYBG_DSP_H */
@@ -0,0 +1,763 @@
+/*
+ * See http://www.asterisk.org for more information about
+ * the Asterisk project. Please do not directly contact
+ * any of the maintainers of this project for assistance;
+ * the project provides a web site, mailing lists and IRC
+ * channels for your use.
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+*/
+
+/*! \file
+ *
+ * \brief Disk reads of app_playbg: shared handles, io_uring prefetch, page cache hints
+ */
+
+#ifndef _PLAYBG_IO_H
+#define _PLAYBG_IO_H
+
+/* Shared file handles */
+#define PLAYBG_SHARED_BUCKETS 64
+#define PLAYBG_SHARED_WINDOW (128 * 1024)
+#define PLAYBG_SHARED_MISSES 16
+
+struct playbg_shared {
+	char *path;
+	unsigned int hash;
+	dev_t dev;
+	ino_t ino;
+	int fd;
+	off_t size;
+	int refs;			/*!< under playbg_shared_lock */
+	ast_mutex_t lock;		/*!< protects the window */
+	ast_cond_t cond;		/*!< signalled when a refill is done */
+	int refilling;			/*!< win is being read into, under lock */
+	off_t win_off;
+	ssize_t win_len;
+	unsigned char *win;
+	int misses;			/*!< reads around the window since its last hit */
+	int ahead;			/*!< PLAYBG_AHEAD_*, under lock */
+	int ahead_buf;			/*!< prefetch buffer holding the next window */
+	off_t ahead_off;
+	ssize_t ahead_len;
+	AST_LIST_ENTRY(playbg_shared) list;
+};
+
+enum {
+	PLAYBG_AHEAD_NONE,
+	PLAYBG_AHEAD_PENDING,	/*!< read submitted, buffer not ours */
+	PLAYBG_AHEAD_READY,	/*!< ahead_buf holds ahead_len bytes at ahead_off */
+};
+
+static int playbg_uring_prefetch(struct playbg_shared *file, off_t offset);
+static unsigned char *playbg_uring_buffer(int buf);
+static void playbg_uring_release(int buf);
+
+struct playbg_shared_cookie {
+	struct playbg_shared *file;
+	off64_t pos;
+};
+
+static AST_LIST_HEAD_NOLOCK(playbg_shared_bucket, playbg_shared) playbg_shared_files[PLAYBG_SHARED_BUCKETS];
+AST_MUTEX_DEFINE_STATIC(playbg_shared_lock);
+static int playbg_shared_count;
+
+
+static void playbg_shared_unref(struct playbg_shared *file)
+{
+	ast_mutex_lock(&playbg_shared_lock);
+	if (--file->refs) {
+		ast_mutex_unlock(&playbg_shared_lock);
+		return;
+	}
+	AST_LIST_REMOVE(&playbg_shared_files[file->hash % PLAYBG_SHARED_BUCKETS], file, list);
+	playbg_shared_count--;
+	ast_mutex_unlock(&playbg_shared_lock);
+
+	/* a prefetch holds a reference, so one that is ready was never consumed */
+	if (file->ahead == PLAYBG_AHEAD_READY)
+		playbg_uring_release(file->ahead_buf);
+	close(file->fd);
+	ast_cond_destroy(&file->cond);
+	ast_mutex_destroy(&file->lock);
+	ast_free(file->win);
+	ast_free(file->path);
+	ast_free(file);
+}
+
+
+static struct playbg_shared *playbg_shared_find(const char *path, const struct stat *st, unsigned int hash)
+{
+	struct playbg_shared *file;
+
+	AST_LIST_TRAVERSE(&playbg_shared_files[hash % PLAYBG_SHARED_BUCKETS], file, list) {
+		if (file->dev == st->st_dev && file->ino == st->st_ino && !strcmp(file->path, path)) {
+			file->refs++;
+			break;
+		}
+	}
+	return file;
+}
+
+
+static void playbg_shared_free(struct playbg_shared *file)
+{
+	if (file->fd >= 0)
+		close(file->fd);
+	if (file->path)
+		ast_free(file->path);
+	if (file->win)
+		ast_free(file->win);
+	ast_free(file);
+}
+
+
+/*! \brief Shared handle of the file st describes, opened on first use */
+static struct playbg_shared *playbg_shared_get(const char *path, const struct stat *st)
+{
+	unsigned int hash = playbg_hash(path, "", 0);
+	struct playbg_shared *file, *other;
+	struct stat fst;
+
+	ast_mutex_lock(&playbg_shared_lock);
+	file = playbg_shared_find(path, st, hash);
+	ast_mutex_unlock(&playbg_shared_lock);
+	if (file)
+		return file;
+
+	if (!(file = ast_calloc(1, sizeof(*file))))
+		return NULL;
+	file->fd = open(path, O_RDONLY);
+	/* what we opened has to be what the core opened */
+	if (file->fd < 0 || fstat(file->fd, &fst) || fst.st_dev != st->st_dev || fst.st_ino != st->st_ino
+	    || !(file->path = ast_strdup(path)) || !(file->win = ast_malloc(PLAYBG_SHARED_WINDOW))) {
+		playbg_shared_free(file);
+		return NULL;
+	}
+
+	ast_mutex_lock(&playbg_shared_lock);
+	if ((other = playbg_shared_find(path, st, hash))) {
+		ast_mutex_unlock(&playbg_shared_lock);
+		playbg_shared_free(file);
+		return other;
+	}
+	file->hash = hash;
+	file->dev = fst.st_dev;
+	file->ino = fst.st_ino;
+	file->size = fst.st_size;
+	file->refs = 1;
+	file->ahead_buf = -1;
+	ast_mutex_init(&file->lock);
+	ast_cond_init(&file->cond, NULL);
+	AST_LIST_INSERT_HEAD(&playbg_shared_files[hash % PLAYBG_SHARED_BUCKETS], file, list);
+	playbg_shared_count++;
+	ast_mutex_unlock(&playbg_shared_lock);
+	return file;
+}
+
+
+static ssize_t playbg_shared_pread(struct playbg_shared_cookie *c, char *buf, size_t size)
+{
+	ssize_t n;
+
+	playbg_count(PLAYBG_CNT_WINDOW_DIRECT);
+	if ((n = pread(c->file->fd, buf, size, c->pos)) > 0)
+		c->pos += n;
+	return n;
+}
+
+
+static ssize_t playbg_shared_read(void *cookie, char *buf, size_t size)
+{
+	struct playbg_shared_cookie *c = cookie;
+	struct playbg_shared *file = c->file;
+	off_t off;
+	ssize_t n;
+
+	if (c->pos >= file->size)
+		return 0;
+	size = MIN(size, file->size - c->pos);
+
+	if (size > PLAYBG_SHARED_WINDOW) {
+		if ((n = pread(file->fd, buf, size, c->pos)) > 0)
+			c->pos += n;
+		return n;
+	}
+
+	ast_mutex_lock(&file->lock);
+	while (file->refilling)
+		ast_cond_wait(&file->cond, &file->lock);
+	if (c->pos < file->win_off || c->pos + size > file->win_off + file->win_len) {
+		if (file->ahead == PLAYBG_AHEAD_READY && c->pos >= file->ahead_off && c->pos + size <= file->ahead_off + file->ahead_len) {
+			/* prefetched while the previous window was being played */
+			memcpy(file->win, playbg_uring_buffer(file->ahead_buf), file->ahead_len);
+			file->win_off = file->ahead_off;
+			file->win_len = file->ahead_len;
+			playbg_count(PLAYBG_CNT_WINDOW_URING);
+		} else if (file->win_len && (c->pos < file->win_off || c->pos > file->win_off + file->win_len)
+		    && file->misses < PLAYBG_SHARED_MISSES) {
+			file->misses++;
+			ast_mutex_unlock(&file->lock);
+			return playbg_shared_pread(c, buf, size);
+		} else {
+			/* nobody touches win while refilling is set */
+			off = c->pos & ~((off_t) 4095);
+			file->refilling = 1;
+			ast_mutex_unlock(&file->lock);
+			n = pread(file->fd, file->win, PLAYBG_SHARED_WINDOW, off);
+			ast_mutex_lock(&file->lock);
+			file->refilling = 0;
+			file->win_off = off;
+			file->win_len = MAX(n, 0);
+			ast_cond_broadcast(&file->cond);
+			if (n < 0) {
+				ast_mutex_unlock(&file->lock);
+				return -1;
+			}
+			playbg_count(PLAYBG_CNT_WINDOW_PREAD);
+		}
+		if (file->ahead == PLAYBG_AHEAD_READY) {
+			/* used or stale, either way done with */
+			playbg_uring_release(file->ahead_buf);
+			file->ahead = PLAYBG_AHEAD_NONE;
+		}
+	}
+	file->misses = 0;
+	if ((n = MIN((off_t) size, file->win_off + file->win_len - c->pos)) <= 0) {
+		/* the window came back short of us, the file may have shrunk: not EOF yet */
+		ast_mutex_unlock(&file->lock);
+		return playbg_shared_pread(c, buf, size);
+	}
+	memcpy(buf, file->win + (c->pos - file->win_off), n);
+	/* half way through a full window, ask for the next one */
+	if (file->ahead == PLAYBG_AHEAD_NONE && file->win_len == PLAYBG_SHARED_WINDOW
+	    && c->pos + n - file->win_off > PLAYBG_SHARED_WINDOW / 2 && file->win_off + file->win_len < file->size
+	    && !playbg_uring_prefetch(file, file->win_off + file->win_len))
+		file->ahead = PLAYBG_AHEAD_PENDING;
+	ast_mutex_unlock(&file->lock);
+
+	c->pos += n;
+	return n;
+}
+
+
+/*! \brief Channels holding the shared handle of fn, 0 if none */
+static int playbg_shared_users(const char *fn)
+{
+	unsigned int hash = playbg_hash(fn, "", 0);
+	struct playbg_shared *file;
+	int refs = 0;
+
+	ast_mutex_lock(&playbg_shared_lock);
+	AST_LIST_TRAVERSE(&playbg_shared_files[hash % PLAYBG_SHARED_BUCKETS], file, list) {
+		if (!strcmp(file->path, fn))
+			refs += file->refs;
+	}
+	ast_mutex_unlock(&playbg_shared_lock);
+	return refs;
+}
+
+
+static int playbg_shared_seek(void *cookie, off64_t *offset, int whence)
+{
+	struct playbg_shared_cookie *c = cookie;
+	off64_t pos;
+
+	switch (whence) {
+	case SEEK_SET:
+		pos = *offset;
+		break;
+	case SEEK_CUR:
+		pos = c->pos + *offset;
+		break;
+	case SEEK_END:
+		pos = c->file->size + *offset;
+		break;
+	default:
+		return -1;
+	}
+	if (pos < 0)
+		return -1;
+	*offset = c->pos = pos;
+	return 0;
+}
+
+
+static int playbg_shared_close(void *cookie)
+{
+	struct playbg_shared_cookie *c = cookie;
+
+	playbg_shared_unref(c->file);
+	ast_free(c);
+	return 0;
+}
+
+
+static cookie_io_functions_t playbg_shared_io = {
+	.read = playbg_shared_read,
+	.seek = playbg_shared_seek,
+	.close = playbg_shared_close,
+};
+
+
+/* io_uring prefetch of shared windows */
+#define PLAYBG_URING_BUFS 32
+#define PLAYBG_URING_ENTRIES 64
+
+struct playbg_prefetch {
+	struct playbg_shared *file;	/*!< holds a reference until completion */
+	off_t offset;
+	AST_LIST_ENTRY(playbg_prefetch) list;
+};
+
+static AST_LIST_HEAD_NOLOCK_STATIC(playbg_prefetches, playbg_prefetch);
+AST_MUTEX_DEFINE_STATIC(playbg_uring_lock);
+static ast_cond_t playbg_uring_cond;
+static pthread_t playbg_uring_thread = AST_PTHREADT_NULL;
+static int playbg_uring_stop;
+static int playbg_uring_fd = -1;
+static unsigned char *playbg_uring_bufs;
+static int playbg_uring_free[PLAYBG_URING_BUFS];	/*!< stack of free buffer numbers */
+static int playbg_uring_nfree;
+static int playbg_uring_fixed;			/*!< buffers registered with the ring */
+
+
+static unsigned char *playbg_uring_buffer(int buf)
+{
+	return playbg_uring_bufs + (size_t) buf * PLAYBG_SHARED_WINDOW;
+}
+
+
+static void playbg_uring_release(int buf)
+{
+	ast_mutex_lock(&playbg_uring_lock);
+	playbg_uring_free[playbg_uring_nfree++] = buf;
+	/* the thread may be waiting for one with reads queued */
+	if (playbg_uring_thread != AST_PTHREADT_NULL)
+		ast_cond_signal(&playbg_uring_cond);
+	ast_mutex_unlock(&playbg_uring_lock);
+}
+
+
+/*! \brief Queue a read of a window, called with file->lock held. 0 if queued */
+static int playbg_uring_prefetch(struct playbg_shared *file, off_t offset)
+{
+	struct playbg_prefetch *req;
+
+	if (!playbg_uring || playbg_uring_thread == AST_PTHREADT_NULL || !(req = ast_calloc(1, sizeof(*req))))
+		return -1;
+
+	ast_mutex_lock(&playbg_shared_lock);
+	file->refs++;
+	ast_mutex_unlock(&playbg_shared_lock);
+	req->file = file;
+	req->offset = offset;
+
+	ast_mutex_lock(&playbg_uring_lock);
+	if (playbg_uring_stop) {
+		/* the thread may be gone already, nobody would complete it */
+		ast_mutex_unlock(&playbg_uring_lock);
+		playbg_shared_unref(file);
+		ast_free(req);
+		return -1;
+	}
+	AST_LIST_INSERT_TAIL(&playbg_prefetches, req, list);
+	ast_cond_signal(&playbg_uring_cond);
+	ast_mutex_unlock(&playbg_uring_lock);
+	return 0;
+}
+
+
+#ifdef PLAYBG_HAVE_URING
+struct playbg_uring_ring {
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq_map, *cq_map;
+	size_t sq_size, cq_size, sqes_size;
+};
+
+static struct playbg_uring_ring playbg_ring;
+
+
+static int playbg_uring_setup(void)
+{
+	struct io_uring_params p;
+	struct playbg_uring_ring *r = &playbg_ring;
+	struct iovec iov;
+	int fd;
+
+	memset(&p, 0, sizeof(p));
+	if ((fd = syscall(__NR_io_uring_setup, PLAYBG_URING_ENTRIES, &p)) < 0)
+		return -1;
+
+	r->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	r->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		r->sq_size = r->cq_size = MAX(r->sq_size, r->cq_size);
+	r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+	r->sq_map = mmap(NULL, r->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	r->cq_map = (p.features & IORING_FEAT_SINGLE_MMAP) ? r->sq_map
+		: mmap(NULL, r->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+	r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+	if (r->sq_map == MAP_FAILED || r->cq_map == MAP_FAILED || r->sqes == MAP_FAILED) {
+		if (r->sq_map != MAP_FAILED)
+			munmap(r->sq_map, r->sq_size);
+		if (r->cq_map != MAP_FAILED && r->cq_map != r->sq_map)
+			munmap(r->cq_map, r->cq_size);
+		if (r->sqes != MAP_FAILED)
+			munmap(r->sqes, r->sqes_size);
+		close(fd);
+		return -1;
+	}
+	r->sq_head = (unsigned *) ((char *) r->sq_map + p.sq_off.head);
+	r->sq_tail = (unsigned *) ((char *) r->sq_map + p.sq_off.tail);
+	r->sq_mask = (unsigned *) ((char *) r->sq_map + p.sq_off.ring_mask);
+	r->sq_array = (unsigned *) ((char *) r->sq_map + p.sq_off.array);
+	r->cq_head = (unsigned *) ((char *) r->cq_map + p.cq_off.head);
+	r->cq_tail = (unsigned *) ((char *) r->cq_map + p.cq_off.tail);
+	r->cq_mask = (unsigned *) ((char *) r->cq_map + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe *) ((char *) r->cq_map + p.cq_off.cqes);
+
+	/* one iovec for the whole pool, buffer n is at n * PLAYBG_SHARED_WINDOW */
+	iov.iov_base = playbg_uring_bufs;
+	iov.iov_len = (size_t) PLAYBG_URING_BUFS * PLAYBG_SHARED_WINDOW;
+	playbg_uring_fixed = !syscall(__NR_io_uring_register, fd, IORING_REGISTER_BUFFERS, &iov, 1);
+	return fd;
+}
+
+
+static void playbg_uring_teardown(void)
+{
+	struct playbg_uring_ring *r = &playbg_ring;
+
+	munmap(r->sqes, r->sqes_size);
+	if (r->cq_map != r->sq_map)
+		munmap(r->cq_map, r->cq_size);
+	munmap(r->sq_map, r->sq_size);
+	close(playbg_uring_fd);
+	playbg_uring_fd = -1;
+}
+
+
+static void playbg_uring_complete(struct playbg_prefetch *req, int buf, int res)
+{
+	struct playbg_shared *file = req->file;
+
+	ast_mutex_lock(&file->lock);
+	if (res > 0) {
+		file->ahead_buf = buf;
+		file->ahead_off = req->offset;
+		file->ahead_len = res;
+		file->ahead = PLAYBG_AHEAD_READY;
+		buf = -1;
+	} else {
+		file->ahead = PLAYBG_AHEAD_NONE;
+	}
+	ast_mutex_unlock(&file->lock);
+	if (buf >= 0)
+		playbg_uring_release(buf);
+	playbg_shared_unref(file);
+	ast_free(req);
+}
+
+
+static void *playbg_uring_run(void *data)
+{
+	struct playbg_uring_ring *r = &playbg_ring;
+	struct playbg_prefetch *inflight[PLAYBG_URING_BUFS] = { NULL, };
+	struct playbg_prefetch *req, *next;
+	struct io_uring_sqe *sqe;
+	struct io_uring_cqe *cqe;
+	struct iovec iovs[PLAYBG_URING_BUFS];
+	unsigned tail, head;
+	int ninflight = 0, nsubmit, buf;
+
+	for (;;) {
+		nsubmit = 0;
+		ast_mutex_lock(&playbg_uring_lock);
+		/* nothing to reap, and nothing to submit until a window gives a buffer back */
+		while (!playbg_uring_stop && !ninflight && (AST_LIST_EMPTY(&playbg_prefetches) || !playbg_uring_nfree))
+			ast_cond_wait(&playbg_uring_cond, &playbg_uring_lock);
+		if (playbg_uring_stop && !ninflight && (AST_LIST_EMPTY(&playbg_prefetches) || !playbg_uring_nfree)) {
+			/* reads still waiting for a buffer are dropped, their files read with pread() */
+			req = AST_LIST_FIRST(&playbg_prefetches);
+			AST_LIST_HEAD_INIT_NOLOCK(&playbg_prefetches);
+			ast_mutex_unlock(&playbg_uring_lock);
+			for (; req; req = next) {
+				next = AST_LIST_NEXT(req, list);
+				playbg_uring_complete(req, -1, -1);
+			}
+			break;
+		}
+		/* batch everything queued meanwhile, as far as buffers go */
+		tail = *r->sq_tail;
+		while (playbg_uring_nfree && (req = AST_LIST_REMOVE_HEAD(&playbg_prefetches, list))) {
+			buf = playbg_uring_free[--playbg_uring_nfree];
+			inflight[buf] = req;
+			sqe = &r->sqes[tail & *r->sq_mask];
+			memset(sqe, 0, sizeof(*sqe));
+			sqe->fd = req->file->fd;
+			sqe->off = req->offset;
+			sqe->user_data = buf;
+			if (playbg_uring_fixed) {
+				sqe->opcode = IORING_OP_READ_FIXED;
+				sqe->addr = (unsigned long) playbg_uring_buffer(buf);
+				sqe->len = PLAYBG_SHARED_WINDOW;
+				sqe->buf_index = 0;
+			} else {
+				iovs[buf].iov_base = playbg_uring_buffer(buf);
+				iovs[buf].iov_len = PLAYBG_SHARED_WINDOW;
+				sqe->opcode = IORING_OP_READV;
+				sqe->addr = (unsigned long) &iovs[buf];
+				sqe->len = 1;
+			}
+			r->sq_array[tail & *r->sq_mask] = tail & *r->sq_mask;
+			tail++;
+			nsubmit++;
+		}
+		ast_mutex_unlock(&playbg_uring_lock);
+		__atomic_store_n(r->sq_tail, tail, __ATOMIC_RELEASE);
+		ninflight += nsubmit;
+
+		if (syscall(__NR_io_uring_enter, playbg_uring_fd, nsubmit, ninflight ? 1 : 0, IORING_ENTER_GETEVENTS, NULL, 0) < 0
+		    && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+			ast_log(LOG_WARNING, "io_uring_enter failed: %s\n", strerror(errno));
+			usleep(1000);
+		}
+
+		head = *r->cq_head;
+		while (head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+			cqe = &r->cqes[head & *r->cq_mask];
+			buf = cqe->user_data;
+			if ((req = inflight[buf])) {
+				inflight[buf] = NULL;
+				ninflight--;
+				playbg_uring_complete(req, buf, cqe->res);
+			}
+			head++;
+		}
+		__atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+	}
+	return NULL;
+}
+#endif
+
+
+static void playbg_uring_start(void)
+{
+#ifdef PLAYBG_HAVE_URING
+	int i;
+
+	if (!playbg_uring || playbg_uring_thread != AST_PTHREADT_NULL)
+		return;
+	if (!playbg_uring_bufs && !(playbg_uring_bufs = ast_malloc((size_t) PLAYBG_URING_BUFS * PLAYBG_SHARED_WINDOW)))
+		return;
+	if ((playbg_uring_fd = playbg_uring_setup()) < 0) {
+		ast_log(LOG_NOTICE, "io_uring unavailable (%s), shared windows are read with pread()\n", strerror(errno));
+		return;
+	}
+	for (i = 0; i < PLAYBG_URING_BUFS; i++)
+		playbg_uring_free[i] = i;
+	playbg_uring_nfree = PLAYBG_URING_BUFS;
+	playbg_uring_stop = 0;
+	ast_cond_init(&playbg_uring_cond, NULL);
+	if (ast_pthread_create_background(&playbg_uring_thread, NULL, playbg_uring_run, NULL)) {
+		ast_log(LOG_WARNING, "Unable to start playbg io_uring thread\n");
+		playbg_uring_thread = AST_PTHREADT_NULL;
+		ast_cond_destroy(&playbg_uring_cond);
+		playbg_uring_teardown();
+		return;
+	}
+	if (option_verbose > 2)
+		ast_verbose(VERBOSE_PREFIX_3 "PlayBG io_uring prefetch started (%s buffers)\n", playbg_uring_fixed ? "registered" : "plain");
+#else
+	if (playbg_uring)
+		ast_log(LOG_NOTICE, "Built without io_uring, shared windows are read with pread()\n");
+#endif
+}
+
+
+#ifdef PLAYBG_HAVE_URING
+/*! \brief Give back the prefetched windows no reader has taken yet */
+static void playbg_uring_drop_ahead(void)
+{
+	struct playbg_shared **files, *file;
+	int i, n = 0;
+
+	ast_mutex_lock(&playbg_shared_lock);
+	if (!(files = ast_calloc(playbg_shared_count + 1, sizeof(*files)))) {
+		ast_mutex_unlock(&playbg_shared_lock);
+		return;
+	}
+	for (i = 0; i < PLAYBG_SHARED_BUCKETS; i++) {
+		AST_LIST_TRAVERSE(&playbg_shared_files[i], file, list) {
+			file->refs++;
+			files[n++] = file;
+		}
+	}
+	ast_mutex_unlock(&playbg_shared_lock);
+
+	for (i = 0; i < n; i++) {
+		ast_mutex_lock(&files[i]->lock);
+		if (files[i]->ahead == PLAYBG_AHEAD_READY) {
+			playbg_uring_release(files[i]->ahead_buf);
+			files[i]->ahead = PLAYBG_AHEAD_NONE;
+		}
+		ast_mutex_unlock(&files[i]->lock);
+		playbg_shared_unref(files[i]);
+	}
+	ast_free(files);
+}
+#endif
+
+
+static void playbg_uring_shutdown(void)
+{
+#ifdef PLAYBG_HAVE_URING
+	if (playbg_uring_thread != AST_PTHREADT_NULL) {
+		/* the thread finishes what is queued and in flight first */
+		ast_mutex_lock(&playbg_uring_lock);
+		playbg_uring_stop = 1;
+		ast_cond_signal(&playbg_uring_cond);
+		ast_mutex_unlock(&playbg_uring_lock);
+		pthread_join(playbg_uring_thread, NULL);
+		playbg_uring_thread = AST_PTHREADT_NULL;
+		ast_cond_destroy(&playbg_uring_cond);
+		playbg_uring_teardown();
+		playbg_uring_drop_ahead();
+	}
+	if (playbg_uring_bufs) {
+		ast_free(playbg_uring_bufs);
+		playbg_uring_bufs = NULL;
+	}
+#endif
+}
+
+
+/*! \brief Formats whose modules only use stdio on their FILE */
+static const char * const playbg_shared_exts[] = {
+	"sln", "raw", "sln16", "ulaw", "ul", "mu", "pcm", "alaw", "al", "gsm",
+};
+
+
+/*! \brief Move a stream the core just opened onto the shared handle of its file */
+static void playbg_shared_attach(struct ast_filestream *fs, const struct playbg_resolved *res)
+{
+	struct playbg_shared_cookie *c;
+	struct stat st;
+	char fn[PATH_MAX + 64];
+	FILE *f;
+	int i;
+
+	for (i = 0; i < ARRAY_LEN(playbg_shared_exts); i++) {
+		if (!strcasecmp(res->ext, playbg_shared_exts[i]))
+			break;
+	}
+	if (i == ARRAY_LEN(playbg_shared_exts))
+		return;
+	if (!fs->f || fstat(fileno(fs->f), &st) || !S_ISREG(st.st_mode))
+		return;
+	playbg_resolved_file(res, fn, sizeof(fn));
+	if (!(c = ast_calloc(1, sizeof(*c))))
+		return;
+	if (!(c->file = playbg_shared_get(fn, &st))) {
+		ast_free(c);
+		return;
+	}
+	c->pos = ftello(fs->f);
+	if (c->pos < 0 || !(f = fopencookie(c, "r", playbg_shared_io))) {
+		playbg_shared_close(c);
+		return;
+	}
+	/* no stdio buffer per channel, the window is the buffer */
+	setvbuf(f, NULL, _IONBF, 0);
+	fclose(fs->f);
+	fs->f = f;
+}
+
+
+/* Page cache hints */
+#define PLAYBG_HINT_SLOTS 256
+#define PLAYBG_HINT_INTERVAL 30
+
+static struct {
+	unsigned int hash;
+	time_t when;
+} playbg_hints[PLAYBG_HINT_SLOTS];
+
+
+/*! \brief Whether fn was hinted lately; racy by design, a duplicate hint is harmless */
+static int playbg_hinted_recently(const char *fn, int advice)
+{
+	unsigned int hash = playbg_hash(fn, "", advice);
+	time_t now = time(NULL);
+	int slot = hash % PLAYBG_HINT_SLOTS;
+
+	if (playbg_hints[slot].hash == hash && now - playbg_hints[slot].when < PLAYBG_HINT_INTERVAL)
+		return 1;
+	playbg_hints[slot].hash = hash;
+	playbg_hints[slot].when = now;
+	return 0;
+}
+
+
+static void playbg_hint_file(const char *fn, int advice, off_t minsize)
+{
+	struct stat st;
+	int fd;
+
+	if (playbg_hinted_recently(fn, advice) || (fd = open(fn, O_RDONLY)) < 0)
+		return;
+	if (!fstat(fd, &st) && st.st_size >= minsize && !posix_fadvise(fd, 0, 0, advice))
+		playbg_count(advice == POSIX_FADV_WILLNEED ? PLAYBG_CNT_HINT_WILLNEED : PLAYBG_CNT_HINT_DONTNEED);
+	close(fd);
+}
+
+
+/*! \brief Hint the file after pos, if it is to be played from disk */
+static void playbg_hint_next(struct ast_channel *chan, struct playbg_state *state, int pos)
+{
+	struct playbg_resolved res;
+	char fn[PATH_MAX + 64];
+	int next = (pos + 1) % state->nfiles;
+
+	if (!playbg_readahead || next == pos || state->audio[next] || !state->filearray[next])
+		return;
+	if (playbg_resolve_cached(state->filearray[next], chan->language, chan->nativeformats, &res))
+		return;
+	playbg_resolved_file(&res, fn, sizeof(fn));
+	playbg_hint_file(fn, POSIX_FADV_WILLNEED, 0);
+}
+
+
+#define PLAYBG_IOSTATS_FRAMES 50	/* frames read between two getrusage() */
+
+/*! \brief Read a frame from disk, with iostats accounting what it cost */
+static struct ast_frame *playbg_stream_read(struct playbg_state *state, struct ast_filestream *fs)
+{
+	struct rusage now;
+
+	if (!playbg_iostats) {
+		state->io_frames = 0;
+		return ast_readframe(fs);
+	}
+	if (!(state->io_frames++ % PLAYBG_IOSTATS_FRAMES) && !getrusage(RUSAGE_THREAD, &now)) {
+		/* another thread's usage is no base to count from */
+		if (state->io_frames > 1 && pthread_equal(state->io_thread, pthread_self())) {
+			if (now.ru_majflt > state->io_usage.ru_majflt)
+				playbg_count_add(PLAYBG_CNT_READ_MAJFLT, now.ru_majflt - state->io_usage.ru_majflt);
+			if (now.ru_inblock > state->io_usage.ru_inblock)
+				playbg_count_add(PLAYBG_CNT_READ_INBLOCK, now.ru_inblock - state->io_usage.ru_inblock);
+		}
+		state->io_usage = now;
+		state->io_thread = pthread_self();
+	}
+	return ast_readframe(fs);
+}
+
+#endif /* _PLAYBG_IO_H */
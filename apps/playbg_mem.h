@@ -0,0 +1,545 @@
+/*
+ * See http://www.asterisk.org for more information about
+ * the Asterisk project. Please do not directly contact
+ * any of the maintainers of this project for assistance;
+ * the project provides a web site, mailing lists and IRC
+ * channels for your use.
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+*/
+
+/*! \file
+ *
+ * \brief Memory behind the audio cache of app_playbg: sound banks, huge pages, shared objects
+ */
+
+#ifndef _PLAYBG_MEM_H
+#define _PLAYBG_MEM_H
+
+/* Sound banks */
+struct playbg_bank {
+	char *name;
+	char *path;
+	time_t mtime;
+	const unsigned char *map;
+	size_t size;
+	const struct playbg_bank_entry *entries;
+	int count;
+	int refs;
+	AST_LIST_ENTRY(playbg_bank) list;
+};
+
+static AST_LIST_HEAD_NOLOCK_STATIC(playbg_banks, playbg_bank);
+AST_MUTEX_DEFINE_STATIC(playbg_bank_lock);
+
+
+static void playbg_bank_unref(struct playbg_bank *bank)
+{
+	if (!bank || !ast_atomic_dec_and_test(&bank->refs))
+		return;
+	munmap((void *) bank->map, bank->size);
+	ast_free(bank->name);
+	if (bank->path)
+		ast_free(bank->path);
+	ast_free(bank);
+}
+
+
+/*! \brief Check a mapped bank once, so lookups can trust its index */
+static int playbg_bank_valid(const char *path, const unsigned char *map, size_t size)
+{
+	const struct playbg_bank_header *header = (const void *) map;
+	const struct playbg_bank_entry *entries = (const void *) (header + 1);
+	uint32_t i;
+
+	if (size < sizeof(*header) || memcmp(header->magic, PLAYBG_BANK_MAGIC, sizeof(PLAYBG_BANK_MAGIC))
+	    || header->byteorder != PLAYBG_BANK_BYTEORDER || header->version != PLAYBG_BANK_VERSION) {
+		ast_log(LOG_WARNING, "'%s' is not a playbg bank of this version and byte order\n", path);
+		return 0;
+	}
+	if (header->size != size || header->count > (size - sizeof(*header)) / sizeof(*entries)) {
+		ast_log(LOG_WARNING, "Bank '%s' is truncated\n", path);
+		return 0;
+	}
+	for (i = 0; i < header->count; i++) {
+		if (entries[i].name[PLAYBG_BANK_NAME - 1] || entries[i].offset > size || entries[i].length > size - entries[i].offset
+		    || (i && strcmp(entries[i - 1].name, entries[i].name) >= 0)) {
+			ast_log(LOG_WARNING, "Bank '%s' has a bad index at entry %u\n", path, i);
+			return 0;
+		}
+		if (!playbg_bank_format_valid(entries[i].encoding, entries[i].rate)) {
+			ast_log(LOG_WARNING, "Bank '%s' member '%s' has encoding %u at %u Hz, which playbg cannot play\n",
+				path, entries[i].name, entries[i].encoding, entries[i].rate);
+			return 0;
+		}
+	}
+	return 1;
+}
+
+
+/*! \brief Map a bank and add it to the list, with playbg_bank_lock held */
+static struct playbg_bank *playbg_bank_map(const char *name, int len)
+{
+	struct playbg_bank *bank = NULL;
+	char path[PATH_MAX];
+	struct stat st;
+	void *map = MAP_FAILED;
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/sounds/%.*s%s", ast_config_AST_DATA_DIR, len, name, PLAYBG_BANK_EXT);
+	if ((fd = open(path, O_RDONLY)) < 0)
+		return NULL;
+	if (!fstat(fd, &st) && st.st_size > 0)
+		map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		ast_log(LOG_WARNING, "Unable to map bank '%s': %s\n", path, strerror(errno));
+		return NULL;
+	}
+	if (!playbg_bank_valid(path, map, st.st_size) || !(bank = ast_calloc(1, sizeof(*bank)))
+	    || !(bank->name = ast_strndup(name, len))) {
+		if (bank)
+			ast_free(bank);
+		munmap(map, st.st_size);
+		return NULL;
+	}
+	bank->path = ast_strdup(path);
+	bank->mtime = st.st_mtime;
+	bank->map = map;
+	bank->size = st.st_size;
+	bank->entries = (const void *) ((const struct playbg_bank_header *) map + 1);
+	bank->count = ((const struct playbg_bank_header *) map)->count;
+	bank->refs = 1;			/* the list's */
+	AST_LIST_INSERT_HEAD(&playbg_banks, bank, list);
+	if (option_verbose > 2)
+		ast_verbose(VERBOSE_PREFIX_3 "Mapped bank '%s', %d members\n", path, bank->count);
+	return bank;
+}
+
+
+/*! \brief Get a bank by name, mapping it on first use */
+static struct playbg_bank *playbg_bank_get(const char *name, int len)
+{
+	struct playbg_bank *bank;
+
+	ast_mutex_lock(&playbg_bank_lock);
+	AST_LIST_TRAVERSE(&playbg_banks, bank, list) {
+		if (!strncmp(bank->name, name, len) && !bank->name[len])
+			break;
+	}
+	if (!bank)
+		bank = playbg_bank_map(name, len);
+	if (bank)
+		ast_atomic_fetchadd_int(&bank->refs, 1);
+	ast_mutex_unlock(&playbg_bank_lock);
+	return bank;
+}
+
+
+/*! \brief Forget mapped banks; channels playing from them keep theirs */
+static void playbg_bank_flush(void)
+{
+	struct playbg_bank *bank;
+
+	ast_mutex_lock(&playbg_bank_lock);
+	while ((bank = AST_LIST_REMOVE_HEAD(&playbg_banks, list)))
+		playbg_bank_unref(bank);
+	ast_mutex_unlock(&playbg_bank_lock);
+}
+
+
+static int playbg_bank_compare(const void *key, const void *entry)
+{
+	return strcmp(key, ((const struct playbg_bank_entry *) entry)->name);
+}
+
+
+struct playbg_bank_lookup {
+	const struct playbg_bank *bank;
+	const struct playbg_bank_entry *entry;
+};
+
+
+static int playbg_bank_exists(const char *key, void *data)
+{
+	struct playbg_bank_lookup *lookup = data;
+
+	if (strlen(key) >= PLAYBG_BANK_NAME)
+		return 0;
+	lookup->entry = bsearch(key, lookup->bank->entries, lookup->bank->count, sizeof(*lookup->bank->entries), playbg_bank_compare);
+	return lookup->entry != NULL;
+}
+
+
+static const struct playbg_bank_entry *playbg_bank_member_lang(const struct playbg_bank *bank, const char *member, const char *lang)
+{
+	struct playbg_bank_lookup lookup = { bank, NULL };
+
+	return playbg_lang_layouts(member, lang, playbg_bank_exists, &lookup) ? lookup.entry : NULL;
+}
+
+
+/*! \brief Find a member of a bank, in the language order of playbg_resolve() */
+static const struct playbg_bank_entry *playbg_bank_member(const struct playbg_bank *bank, const char *member, const char *preflang)
+{
+	const struct playbg_bank_entry *entry;
+	char lang[MAX_LANGUAGE];
+	char *c;
+
+	if (!ast_strlen_zero(preflang)) {
+		if ((entry = playbg_bank_member_lang(bank, member, preflang)))
+			return entry;
+		ast_copy_string(lang, preflang, sizeof(lang));
+		if ((c = strchr(lang, '_'))) {
+			*c = '\0';
+			if ((entry = playbg_bank_member_lang(bank, member, lang)))
+				return entry;
+		}
+	}
+	if ((entry = playbg_bank_member_lang(bank, member, NULL)))
+		return entry;
+	if (ast_strlen_zero(preflang) || strcmp(preflang, "en"))
+		return playbg_bank_member_lang(bank, member, "en");
+	return NULL;
+}
+
+
+/*! \brief Look up "bank:<bank>/<member>" */
+static const struct playbg_bank_entry *playbg_bank_find(const char *name, const char *language, struct playbg_bank **bank)
+{
+	const struct playbg_bank_entry *entry;
+	const char *member;
+
+	name += strlen("bank:");
+	if (!(member = strchr(name, '/')) || !(*bank = playbg_bank_get(name, member - name)))
+		return NULL;
+	if (!(entry = playbg_bank_member(*bank, member + 1, language))) {
+		playbg_bank_unref(*bank);
+		*bank = NULL;
+	}
+	return entry;
+}
+
+
+static int playbg_bank_samples(const struct playbg_bank_entry *entry)
+{
+	return entry->encoding == PLAYBG_BANK_SLIN ? entry->length / sizeof(short) : entry->length;
+}
+
+
+/* Huge page arena */
+#define PLAYBG_HUGE_PAGE (2 * 1024 * 1024)
+#define PLAYBG_HUGE_CHUNK (8 * PLAYBG_HUGE_PAGE)
+
+struct playbg_huge {
+	unsigned char *base;
+	size_t size;
+	size_t used;
+	int refs;			/*!< files in it, plus one while it is the current chunk */
+	int explicit;			/*!< from the hugetlb pool */
+};
+
+static struct playbg_huge *playbg_huge_current;
+static int64_t playbg_huge_bytes;
+AST_MUTEX_DEFINE_STATIC(playbg_huge_lock);
+
+
+static void playbg_huge_unref(struct playbg_huge *chunk)
+{
+	if (!ast_atomic_dec_and_test(&chunk->refs))
+		return;
+	munmap(chunk->base, chunk->size);
+	__atomic_fetch_sub(&playbg_huge_bytes, (int64_t) chunk->size, __ATOMIC_RELAXED);
+	ast_free(chunk);
+}
+
+
+/*! \brief Map a chunk of at least size bytes, in whole huge pages */
+static struct playbg_huge *playbg_huge_map(size_t size)
+{
+	struct playbg_huge *chunk;
+	unsigned char *map = MAP_FAILED;
+	size_t extra;
+
+	if (!(chunk = ast_calloc(1, sizeof(*chunk))))
+		return NULL;
+	chunk->size = (MAX(size, PLAYBG_HUGE_CHUNK) + PLAYBG_HUGE_PAGE - 1) & ~((size_t) PLAYBG_HUGE_PAGE - 1);
+
+#ifdef MAP_HUGETLB
+	if (playbg_hugepages == PLAYBG_HUGE_EXPLICIT) {
+		map = mmap(NULL, chunk->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		chunk->explicit = map != MAP_FAILED;
+		if (map == MAP_FAILED)
+			playbg_diag(__LOG_NOTICE, PLAYBG_CNT_HUGE_FALLBACK, "No explicit huge pages for %zu kB of audio, using transparent ones", chunk->size / 1024);
+	}
+#endif
+	if (map == MAP_FAILED) {
+		/* over-map by a page and trim, the kernel only backs aligned ranges */
+		if ((map = mmap(NULL, chunk->size + PLAYBG_HUGE_PAGE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED) {
+			ast_free(chunk);
+			return NULL;
+		}
+		extra = (PLAYBG_HUGE_PAGE - ((uintptr_t) map & (PLAYBG_HUGE_PAGE - 1))) & (PLAYBG_HUGE_PAGE - 1);
+		if (extra)
+			munmap(map, extra);
+		munmap(map + extra + chunk->size, PLAYBG_HUGE_PAGE - extra);
+		map += extra;
+#ifdef MADV_HUGEPAGE
+		if (madvise(map, chunk->size, MADV_HUGEPAGE))
+#endif
+			playbg_diag(__LOG_NOTICE, PLAYBG_CNT_HUGE_FALLBACK, "No transparent huge pages for audio, using normal ones");
+	}
+	chunk->base = map;
+	chunk->refs = 1;
+	__atomic_fetch_add(&playbg_huge_bytes, (int64_t) chunk->size, __ATOMIC_RELAXED);
+	if (option_debug)
+		ast_log(LOG_DEBUG, "Mapped %zu kB of %s huge pages for audio\n", chunk->size / 1024, chunk->explicit ? "explicit" : "transparent");
+	return chunk;
+}
+
+
+/*! \brief Move audio into the arena */
+static short *playbg_huge_copy(const short *data, int samples, struct playbg_huge **chunk)
+{
+	size_t size = ((size_t) samples * sizeof(*data) + 63) & ~(size_t) 63;
+	struct playbg_huge *c;
+	short *copy;
+
+	ast_mutex_lock(&playbg_huge_lock);
+	if (!(c = playbg_huge_current) || c->size - c->used < size) {
+		if (!(c = playbg_huge_map(size))) {
+			ast_mutex_unlock(&playbg_huge_lock);
+			return NULL;
+		}
+		if (playbg_huge_current)
+			playbg_huge_unref(playbg_huge_current);
+		playbg_huge_current = c;
+	}
+	copy = (short *) (c->base + c->used);
+	c->used += size;
+	ast_atomic_fetchadd_int(&c->refs, 1);
+	ast_mutex_unlock(&playbg_huge_lock);
+
+	memcpy(copy, data, samples * sizeof(*data));
+	*chunk = c;
+	return copy;
+}
+
+
+/*! \brief Let go of the current chunk, at unload; chunks go with their last file */
+static void playbg_huge_flush(void)
+{
+	ast_mutex_lock(&playbg_huge_lock);
+	if (playbg_huge_current)
+		playbg_huge_unref(playbg_huge_current);
+	playbg_huge_current = NULL;
+	ast_mutex_unlock(&playbg_huge_lock);
+}
+
+
+/* Host wide cache */
+#define PLAYBG_SHM_DIR "playbg"
+#define PLAYBG_SHM_MAGIC "PLAYBGSH"
+#define PLAYBG_SHM_VERSION 1
+#define PLAYBG_SHM_HEADER 4096		/* samples start on a page */
+#define PLAYBG_SHM_TMP_AGE 3600		/* temporaries older than this are leftovers, in seconds */
+#define PLAYBG_SHM_LOCK "lock."
+#define PLAYBG_SHM_LOCK_AGE 60		/* a lock file this old has been locked by its instance, in seconds */
+
+struct playbg_shm_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t byteorder;		/*!< PLAYBG_BANK_BYTEORDER as written */
+	int64_t mtime;			/*!< of the source file */
+	int64_t size;
+	uint32_t rate;
+	uint32_t samples;
+	uint64_t checksum;		/*!< playbg_shm_checksum() of the samples */
+	char key[PLAYBG_SHM_HEADER - 48];	/*!< pads the header to PLAYBG_SHM_HEADER */
+};
+
+
+/*! \brief FNV-1a over 64 bit words, plus the odd tail sample */
+static uint64_t playbg_shm_checksum(const short *data, int samples)
+{
+	const uint64_t *w = (const uint64_t *) data;
+	uint64_t h = 0xcbf29ce484222325ULL;
+	size_t i, n = (size_t) samples * sizeof(*data) / sizeof(*w);
+
+	for (i = 0; i < n; i++)
+		h = (h ^ w[i]) * 0x100000001b3ULL;
+	for (i = n * sizeof(*w) / sizeof(*data); i < samples; i++)
+		h = (h ^ (uint16_t) data[i]) * 0x100000001b3ULL;
+	return h;
+}
+
+
+static int playbg_shm_seq;		/*!< makes temporary names unique within the process */
+static char playbg_shm_path[PATH_MAX + 16];	/*!< our directory in sharedcachedir, empty when unusable */
+static char playbg_shm_token[32];	/*!< names our lock file and temporaries */
+static int playbg_shm_lockfd = -1;
+
+
+/*! \brief Whether st is ours alone: owned by us, nobody else can write */
+static int playbg_shm_private(const struct stat *st)
+{
+	return st->st_uid == geteuid() && !(st->st_mode & (S_IWGRP | S_IWOTH));
+}
+
+
+/*! \brief Let go of the shared cache directory, and of our lock in it */
+static void playbg_shm_close(void)
+{
+	char fn[PATH_MAX + 64];
+
+	if (playbg_shm_lockfd >= 0) {
+		snprintf(fn, sizeof(fn), "%s/%s%s", playbg_shm_path, PLAYBG_SHM_LOCK, playbg_shm_token);
+		unlink(fn);
+		close(playbg_shm_lockfd);
+		playbg_shm_lockfd = -1;
+	}
+	playbg_shm_path[0] = '\0';
+}
+
+
+/*! \brief Set up our directory in sharedcachedir and take our lock in it */
+static int playbg_shm_open(void)
+{
+	char dir[PATH_MAX + 16], fn[PATH_MAX + 64];
+	struct stat st;
+	int i, fd = -1;
+
+	snprintf(dir, sizeof(dir), "%s/%s", playbg_shared_cache_dir, PLAYBG_SHM_DIR);
+	if (playbg_shm_lockfd >= 0 && !strcmp(dir, playbg_shm_path))
+		return 0;
+	playbg_shm_close();
+	if (mkdir(dir, 0700) && errno != EEXIST) {
+		ast_log(LOG_WARNING, "Unable to create shared cache directory '%s': %s\n", dir, strerror(errno));
+		return -1;
+	}
+	if (lstat(dir, &st) || !S_ISDIR(st.st_mode) || !playbg_shm_private(&st)) {
+		ast_log(LOG_WARNING, "Shared cache directory '%s' is not a directory of ours that only we can write, not using it\n", dir);
+		return -1;
+	}
+	for (i = 0; i < 100 && fd < 0; i++) {
+		snprintf(playbg_shm_token, sizeof(playbg_shm_token), "%d-%d", (int) getpid(), i);
+		snprintf(fn, sizeof(fn), "%s/%s%s", dir, PLAYBG_SHM_LOCK, playbg_shm_token);
+		if ((fd = open(fn, O_RDWR | O_CREAT | O_EXCL | O_NOFOLLOW, 0600)) < 0 && errno != EEXIST)
+			break;
+	}
+	if (fd < 0 || flock(fd, LOCK_EX | LOCK_NB)) {
+		ast_log(LOG_WARNING, "Unable to lock the shared cache in '%s': %s\n", dir, strerror(errno));
+		if (fd >= 0) {
+			unlink(fn);
+			close(fd);
+		}
+		return -1;
+	}
+	playbg_shm_lockfd = fd;
+	ast_copy_string(playbg_shm_path, dir, sizeof(playbg_shm_path));
+	return 0;
+}
+
+
+/*! \brief Key and object name of a decoded file */
+static int playbg_shm_key(const char *path, int rate, int normalize, char *key, size_t keylen, char *fn, size_t fnlen)
+{
+	const char *c;
+	uint64_t h = 0xcbf29ce484222325ULL;
+
+	if (!playbg_shm_path[0])
+		return -1;
+	if (normalize)
+		snprintf(key, keylen, "%s:%d:%.2f", path, rate, playbg_loudness_target);
+	else
+		snprintf(key, keylen, "%s:%d:-", path, rate);
+	for (c = key; *c; c++)
+		h = (h ^ (unsigned char) *c) * 0x100000001b3ULL;
+	return snprintf(fn, fnlen, "%s/%016llx", playbg_shm_path, (unsigned long long) h) < fnlen ? 0 : -1;
+}
+
+
+/*! \brief Whether the instance that named its lock file name is gone */
+static int playbg_shm_unlocked(int dirfd, const char *name)
+{
+	int fd, res;
+
+	if ((fd = openat(dirfd, name, O_RDONLY | O_NOFOLLOW)) < 0)
+		return errno == ENOENT;
+	/* held by a live instance, whatever its pid has become */
+	res = !flock(fd, LOCK_EX | LOCK_NB);
+	close(fd);
+	return res;
+}
+
+
+/*! \brief Whether an object of the shared cache is left over */
+static int playbg_shm_leftover(int dirfd, const char *name, const struct stat *st)
+{
+	struct playbg_shm_header header;
+	struct stat src;
+	char lock[64], *end;
+	const char *token;
+	int fd, i;
+
+	if (!strncmp(name, PLAYBG_SHM_LOCK, strlen(PLAYBG_SHM_LOCK))) {
+		/* created and locked in one go by its instance, give it that long */
+		return time(NULL) - st->st_mtime > PLAYBG_SHM_LOCK_AGE && playbg_shm_unlocked(dirfd, name);
+	}
+	if (strlen(name) > 4 && !strcmp(name + strlen(name) - 4, ".tmp")) {
+		if (time(NULL) - st->st_mtime > PLAYBG_SHM_TMP_AGE)
+			return 1;
+		/* hash.token.seq.tmp */
+		if (!(token = strchr(name, '.')) || !(end = strchr(++token, '.')) || end - token >= sizeof(lock) - strlen(PLAYBG_SHM_LOCK))
+			return 0;
+		snprintf(lock, sizeof(lock), "%s%.*s", PLAYBG_SHM_LOCK, (int) (end - token), token);
+		return playbg_shm_unlocked(dirfd, lock);
+	}
+	if ((fd = openat(dirfd, name, O_RDONLY | O_NOFOLLOW)) < 0)
+		return 0;
+	i = pread(fd, &header, sizeof(header), 0);
+	close(fd);
+	if (i != sizeof(header) || memcmp(header.magic, PLAYBG_SHM_MAGIC, sizeof(header.magic))
+	    || header.version != PLAYBG_SHM_VERSION || header.byteorder != PLAYBG_BANK_BYTEORDER)
+		return 1;
+
+	/* the key is path:rate:target, and the path may hold colons */
+	header.key[sizeof(header.key) - 1] = '\0';
+	for (i = 0; i < 2; i++) {
+		if (!(end = strrchr(header.key, ':')))
+			return 1;
+		*end = '\0';
+	}
+	return stat(header.key, &src) || (int64_t) src.st_mtime != header.mtime || (int64_t) src.st_size != header.size;
+}
+
+
+/*! \brief Remove what playbg_shm_leftover() finds in the shared cache */
+static void playbg_shm_sweep(void)
+{
+	struct dirent *de;
+	struct stat st;
+	DIR *d;
+	int removed = 0;
+
+	if (!playbg_shm_path[0] || !(d = opendir(playbg_shm_path)))
+		return;
+	while ((de = readdir(d))) {
+		if (de->d_name[0] == '.' || fstatat(dirfd(d), de->d_name, &st, AT_SYMLINK_NOFOLLOW) || !S_ISREG(st.st_mode))
+			continue;
+		/* not ours: left for whoever owns it, playbg_shm_attach() ignores it */
+		if (st.st_uid != geteuid() || !playbg_shm_leftover(dirfd(d), de->d_name, &st))
+			continue;
+		if (!unlinkat(dirfd(d), de->d_name, 0)) {
+			playbg_count(PLAYBG_CNT_SHM_REMOVED);
+			removed++;
+		}
+	}
+	closedir(d);
+	if (removed && option_verbose > 2)
+		ast_verbose(VERBOSE_PREFIX_3 "Removed %d stale objects from the shared cache in '%s'\n", removed, playbg_shm_path);
+}
+
+#endif /* _PLAYBG_MEM_H */
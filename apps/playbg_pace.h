@@ -0,0 +1,91 @@
+/*
+ * See http://www.asterisk.org for more information about
+ * the Asterisk project. Please do not directly contact
+ * any of the maintainers of this project for assistance;
+ * the project provides a web site, mailing lists and IRC
+ * channels for your use.
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+*/
+
+/*! \file
+ *
+ * \brief Pacing of the playbg generator against a clock
+ */
+
+#ifndef _PLAYBG_PACE_H
+#define _PLAYBG_PACE_H
+
+#include <stdint.h>
+
+struct playbg_pacer {
+	int64_t start;			/*!< clock time pacing started at, in usec, 0 to restart */
+	int64_t due;			/*!< samples queued since start */
+	int64_t carry;			/*!< what playbg_pacer_convert() could not count yet */
+};
+
+/*! \brief Samples to queue at clock time now, in usec, for a call asking for samples */
+static inline int playbg_pacer_samples(struct playbg_pacer *pacer, int64_t now, int rate, int samples)
+{
+	int64_t due;
+
+	if (!pacer->start) {
+		pacer->start = now - (int64_t) samples * 1000000 / rate;
+		pacer->due = 0;
+	}
+	due = (now - pacer->start) * rate / 1000000;
+	samples = due > pacer->due ? (int) (due - pacer->due) : 0;
+	pacer->due += samples;
+	return samples;
+}
+
+
+/*! \brief Length of a frame at rate, in samples at chanrate */
+static inline int playbg_pacer_convert(struct playbg_pacer *pacer, int samples, int rate, int chanrate)
+{
+	int64_t n;
+
+	if (rate == chanrate || rate <= 0)
+		return samples;
+	n = (int64_t) samples * chanrate + pacer->carry;
+	pacer->carry = n % rate;
+	return n / rate;
+}
+
+
+/*! \brief What a generator call does with the samples it queues, see playbg_pace_run() */
+struct playbg_pace_ops {
+	/*! Build the next frame: its length in samples at the pacing rate, possibly 0, -1 if there is none */
+	int (*next)(void *data);
+	/*! Send the frame next() built, or suppress it (DTX); -1 on failure */
+	int (*send)(void *data);
+	/*! Skip or drop excess samples above the burst, already taken off the queue */
+	void (*overrun)(void *data, int excess);
+};
+
+
+/*! \brief One generator call */
+static inline int playbg_pace_run(struct playbg_pacer *pacer, int *queue, int pacing, int64_t now, int rate, int samples,
+	int burst, const struct playbg_pace_ops *ops, void *data)
+{
+	int n;
+
+	*queue += pacing ? playbg_pacer_samples(pacer, now, rate, samples) : samples;
+	if (burst > 0 && *queue > burst) {
+		n = *queue - burst;
+		*queue = burst;
+		ops->overrun(data, n);
+	}
+	while (*queue > 0) {
+		if ((n = ops->next(data)) < 0)
+			return -1;
+		*queue -= n;
+		if (ops->send(data))
+			return -1;
+	}
+	return 0;
+}
+
+#endif /* _PLAYBG_PACE_H */
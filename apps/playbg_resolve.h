@@ -0,0 +1,692 @@
+/*
+ * See http://www.asterisk.org for more information about
+ * the Asterisk project. Please do not directly contact
+ * any of the maintainers of this project for assistance;
+ * the project provides a web site, mailing lists and IRC
+ * channels for your use.
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+*/
+
+/*! \file
+ *
+ * \brief File resolution of app_playbg and its caches
+ */
+
+#ifndef _PLAYBG_RESOLVE_H
+#define _PLAYBG_RESOLVE_H
+
+/* File resolution */
+struct playbg_resolved {
+	char path[PATH_MAX];	/*!< name to hand to ast_readfile(), without extension */
+	char ext[16];
+	int format;
+};
+
+static const struct playbg_ext {
+	const char *ext;
+	int format;
+} playbg_exts[] = {
+#ifdef AST_FORMAT_SLINEAR16
+	{ "sln16", AST_FORMAT_SLINEAR16 },
+	{ "wav16", AST_FORMAT_SLINEAR16 },
+	{ "g722", AST_FORMAT_G722 },
+#endif
+	{ "sln", AST_FORMAT_SLINEAR },
+	{ "raw", AST_FORMAT_SLINEAR },
+	{ "wav", AST_FORMAT_SLINEAR },
+	{ "ulaw", AST_FORMAT_ULAW },
+	{ "pcm", AST_FORMAT_ULAW },
+	{ "alaw", AST_FORMAT_ALAW },
+	{ "al", AST_FORMAT_ALAW },
+	{ "gsm", AST_FORMAT_GSM },
+	{ "WAV", AST_FORMAT_GSM },
+	{ "g729", AST_FORMAT_G729A },
+	{ "g726", AST_FORMAT_G726 },
+	{ "ilbc", AST_FORMAT_ILBC },
+	{ "g723", AST_FORMAT_G723_1 },
+	{ "vox", AST_FORMAT_ADPCM },
+	{ "ogg", AST_FORMAT_SLINEAR },
+};
+
+
+/*! \brief Name of a file in a language, in one of the two layouts */
+static int playbg_lang_name(const char *name, const char *lang, int layout, char *buf, size_t len)
+{
+	const char *c = strrchr(name, '/');
+	int offset = c ? c - name + 1 : 0;
+
+	if (!lang)
+		ast_copy_string(buf, name, len);
+	else if (!layout)
+		snprintf(buf, len, "%.*s%s/%s", offset, name, lang, name + offset);
+	else if (name[0] != '/')
+		snprintf(buf, len, "%s/%s", lang, name);
+	else
+		return -1;
+	return 0;
+}
+
+
+/*! \brief Whether a name in a language exists, in the layout order of the core */
+static int playbg_lang_layouts(const char *name, const char *lang, int (*exists)(const char *path, void *data), void *data)
+{
+	char path[PATH_MAX];
+	int i, layout;
+
+	for (i = 0; i < (lang ? 2 : 1); i++) {
+		layout = ast_language_is_prefix ? !i : i;
+		if (!playbg_lang_name(name, lang, layout, path, sizeof(path)) && exists(path, data))
+			return 1;
+	}
+	return 0;
+}
+
+
+struct playbg_resolve_lookup {
+	struct playbg_resolved *res;
+	int prefs;
+};
+
+
+static int playbg_resolve_exists(const char *path, void *data)
+{
+	struct playbg_resolve_lookup *lookup = data;
+	struct playbg_resolved *res = lookup->res;
+	int prefs = lookup->prefs;
+	char fn[PATH_MAX];
+	struct stat st;
+	int i, found = 0;
+
+	for (i = 0; i < ARRAY_LEN(playbg_exts); i++) {
+		if (path[0] == '/')
+			snprintf(fn, sizeof(fn), "%s.%s", path, playbg_exts[i].ext);
+		else
+			snprintf(fn, sizeof(fn), "%s/sounds/%s.%s", ast_config_AST_DATA_DIR, path, playbg_exts[i].ext);
+		if (stat(fn, &st) || !S_ISREG(st.st_mode))
+			continue;
+		if (!found || (playbg_exts[i].format & prefs)) {
+			ast_copy_string(res->path, path, sizeof(res->path));
+			ast_copy_string(res->ext, playbg_exts[i].ext, sizeof(res->ext));
+			res->format = playbg_exts[i].format;
+			found = 1;
+			if (res->format & prefs)
+				break;
+		}
+	}
+	return found;
+}
+
+
+static int playbg_resolve_lang(const char *name, const char *lang, int prefs, struct playbg_resolved *res)
+{
+	struct playbg_resolve_lookup lookup = { res, prefs };
+
+	return playbg_lang_layouts(name, lang, playbg_resolve_exists, &lookup) ? 0 : -1;
+}
+
+
+/*! \brief Full file name of a resolved file, as the core opens it */
+static void playbg_resolved_file(const struct playbg_resolved *res, char *fn, size_t len)
+{
+	if (res->path[0] == '/')
+		snprintf(fn, len, "%s.%s", res->path, res->ext);
+	else
+		snprintf(fn, len, "%s/sounds/%s.%s", ast_config_AST_DATA_DIR, res->path, res->ext);
+}
+
+
+static int playbg_resolve(const char *name, const char *preflang, int prefs, struct playbg_resolved *res)
+{
+	char lang[MAX_LANGUAGE];
+	char *c;
+
+	if (!ast_strlen_zero(preflang)) {
+		if (!playbg_resolve_lang(name, preflang, prefs, res))
+			return 0;
+		ast_copy_string(lang, preflang, sizeof(lang));
+		if ((c = strchr(lang, '_'))) {
+			*c = '\0';
+			if (!playbg_resolve_lang(name, lang, prefs, res))
+				return 0;
+		}
+	}
+	if (!playbg_resolve_lang(name, NULL, prefs, res))
+		return 0;
+	if (ast_strlen_zero(preflang) || strcmp(preflang, "en"))
+		return playbg_resolve_lang(name, "en", prefs, res);
+	return -1;
+}
+
+
+/* Resolution cache */
+#define PLAYBG_RESOLVE_BUCKETS 256
+#define PLAYBG_RESOLVE_TTL 30
+
+struct playbg_resolution {
+	char *name;
+	char *language;
+	int prefs;
+	unsigned int hash;
+	time_t created;
+	char *path;
+	char ext[16];
+	int format;
+	AST_LIST_ENTRY(playbg_resolution) list;
+};
+
+static AST_LIST_HEAD_NOLOCK(playbg_resolution_bucket, playbg_resolution) playbg_resolutions[PLAYBG_RESOLVE_BUCKETS];
+AST_MUTEX_DEFINE_STATIC(playbg_resolve_lock);
+
+struct playbg_watch {
+	int wd;
+	char *dir;
+	AST_LIST_ENTRY(playbg_watch) list;
+};
+
+static AST_LIST_HEAD_NOLOCK_STATIC(playbg_watches, playbg_watch);
+AST_MUTEX_DEFINE_STATIC(playbg_watch_lock);
+
+static int playbg_inotify_fd = -1;
+static pthread_t playbg_inotify_thread = AST_PTHREADT_NULL;
+static int playbg_inotify_stop;
+static int playbg_resolve_generation;	/*!< bumped when a change drops entries, files opened before may be gone */
+
+
+static unsigned int playbg_hash(const char *name, const char *language, int rate)
+{
+	unsigned int hash = 5381 + rate;
+
+	while (*name)
+		hash = hash * 33 + (unsigned char) *name++;
+	hash = hash * 33 + '/';
+	while (*language)
+		hash = hash * 33 + (unsigned char) *language++;
+	return hash;
+}
+
+
+static void playbg_resolution_free(struct playbg_resolution *r)
+{
+	if (r->name)
+		ast_free(r->name);
+	if (r->language)
+		ast_free(r->language);
+	if (r->path)
+		ast_free(r->path);
+	ast_free(r);
+}
+
+
+/*! \brief Directory holding \a path, relative to the sounds directory unless absolute */
+static void playbg_resolve_dir(const char *path, char *dir, size_t len)
+{
+	char *c;
+
+	if (path[0] == '/')
+		ast_copy_string(dir, path, len);
+	else
+		snprintf(dir, len, "%s/sounds/%s", ast_config_AST_DATA_DIR, path);
+	if ((c = strrchr(dir, '/')))
+		*c = '\0';
+}
+
+
+/*! \brief Whether name, in language or in none, would be looked up in dir */
+static int playbg_name_in_dir(const char *name, const char *language, const char *dir)
+{
+	char rdir[PATH_MAX], lname[PATH_MAX];
+
+	playbg_resolve_dir(name, rdir, sizeof(rdir));
+	if (!strcmp(rdir, dir))
+		return 1;
+	if (name[0] == '/' || ast_strlen_zero(language))
+		return 0;
+	snprintf(lname, sizeof(lname), "%s/%s", language, name);
+	playbg_resolve_dir(lname, rdir, sizeof(rdir));
+	return !strcmp(rdir, dir);
+}
+
+
+/*! \brief Forget how name was resolved, e.g. because the file it gave is gone */
+static void playbg_resolve_forget(const char *name, const char *language, int prefs)
+{
+	unsigned int hash = playbg_hash(name, language, prefs);
+	struct playbg_resolution *r;
+
+	ast_mutex_lock(&playbg_resolve_lock);
+	AST_LIST_TRAVERSE_SAFE_BEGIN(&playbg_resolutions[hash % PLAYBG_RESOLVE_BUCKETS], r, list) {
+		if (r->hash == hash && r->prefs == prefs && !strcmp(r->name, name) && !strcmp(r->language, language)) {
+			AST_LIST_REMOVE_CURRENT(&playbg_resolutions[hash % PLAYBG_RESOLVE_BUCKETS], list);
+			playbg_resolution_free(r);
+			break;
+		}
+	}
+	AST_LIST_TRAVERSE_SAFE_END
+	ast_mutex_unlock(&playbg_resolve_lock);
+}
+
+
+/*! \brief Drop the entries resolved from dir, the directory of their name or of their file */
+static void playbg_resolve_flush_dir(const char *dir)
+{
+	struct playbg_resolution *r;
+	char rdir[PATH_MAX];
+	int i, dropped = 0;
+
+	ast_mutex_lock(&playbg_resolve_lock);
+	for (i = 0; i < PLAYBG_RESOLVE_BUCKETS; i++) {
+		AST_LIST_TRAVERSE_SAFE_BEGIN(&playbg_resolutions[i], r, list) {
+			playbg_resolve_dir(r->name, rdir, sizeof(rdir));
+			if (strcmp(rdir, dir)) {
+				playbg_resolve_dir(r->path, rdir, sizeof(rdir));
+				if (strcmp(rdir, dir))
+					continue;
+			}
+			AST_LIST_REMOVE_CURRENT(&playbg_resolutions[i], list);
+			playbg_resolution_free(r);
+			dropped++;
+		}
+		AST_LIST_TRAVERSE_SAFE_END
+	}
+	if (dropped)
+		playbg_resolve_generation++;
+	ast_mutex_unlock(&playbg_resolve_lock);
+	if (option_debug > 2)
+		ast_log(LOG_DEBUG, "%s changed, %d playbg resolutions dropped\n", dir, dropped);
+}
+
+
+static void playbg_resolve_flush(void)
+{
+	struct playbg_resolution *r;
+	int i;
+
+	ast_mutex_lock(&playbg_resolve_lock);
+	for (i = 0; i < PLAYBG_RESOLVE_BUCKETS; i++) {
+		while ((r = AST_LIST_REMOVE_HEAD(&playbg_resolutions[i], list)))
+			playbg_resolution_free(r);
+	}
+	playbg_resolve_generation++;
+	ast_mutex_unlock(&playbg_resolve_lock);
+}
+
+
+/* Negative cache */
+#define PLAYBG_FAILURE_MAX_BACKOFF 300
+#define PLAYBG_FAILURE_LOG_INTERVAL 60
+
+struct playbg_failure {
+	char *name;
+	char *language;
+	unsigned int hash;
+	int failures;
+	int suppressed;		/*!< failures not logged yet */
+	time_t retry;
+	time_t logged;
+	AST_LIST_ENTRY(playbg_failure) list;
+};
+
+static AST_LIST_HEAD_NOLOCK(playbg_failure_bucket, playbg_failure) playbg_failures[PLAYBG_RESOLVE_BUCKETS];
+AST_MUTEX_DEFINE_STATIC(playbg_failure_lock);
+static int playbg_nfailures;
+
+
+static struct playbg_failure *playbg_failure_find(const char *name, const char *language, unsigned int hash)
+{
+	struct playbg_failure *fail;
+
+	AST_LIST_TRAVERSE(&playbg_failures[hash % PLAYBG_RESOLVE_BUCKETS], fail, list) {
+		if (fail->hash == hash && !strcmp(fail->name, name) && !strcmp(fail->language, language))
+			return fail;
+	}
+	return NULL;
+}
+
+
+static void playbg_failure_free(struct playbg_failure *fail)
+{
+	if (fail->name)
+		ast_free(fail->name);
+	if (fail->language)
+		ast_free(fail->language);
+	ast_free(fail);
+}
+
+
+/*! \brief Drop the failures of files looked up in dir, they may be there now */
+static void playbg_failure_flush_dir(const char *dir)
+{
+	struct playbg_failure *fail;
+	int i;
+
+	if (!playbg_nfailures)
+		return;
+	ast_mutex_lock(&playbg_failure_lock);
+	for (i = 0; i < PLAYBG_RESOLVE_BUCKETS; i++) {
+		AST_LIST_TRAVERSE_SAFE_BEGIN(&playbg_failures[i], fail, list) {
+			if (!playbg_name_in_dir(fail->name, fail->language, dir))
+				continue;
+			AST_LIST_REMOVE_CURRENT(&playbg_failures[i], list);
+			playbg_failure_free(fail);
+			playbg_nfailures--;
+		}
+		AST_LIST_TRAVERSE_SAFE_END
+	}
+	ast_mutex_unlock(&playbg_failure_lock);
+}
+
+
+static void playbg_failure_flush(void)
+{
+	struct playbg_failure *fail;
+	int i;
+
+	ast_mutex_lock(&playbg_failure_lock);
+	for (i = 0; i < PLAYBG_RESOLVE_BUCKETS; i++) {
+		while ((fail = AST_LIST_REMOVE_HEAD(&playbg_failures[i], list)))
+			playbg_failure_free(fail);
+	}
+	playbg_nfailures = 0;
+	ast_mutex_unlock(&playbg_failure_lock);
+}
+
+
+/*! \brief Check whether a file is backing off after failing to open */
+static int playbg_failed_recently(const char *name, const char *language)
+{
+	unsigned int hash;
+	struct playbg_failure *fail;
+	time_t now;
+	int res = 0;
+
+	if (!playbg_nfailures)
+		return 0;
+
+	hash = playbg_hash(name, language, 0);
+	now = time(NULL);
+	ast_mutex_lock(&playbg_failure_lock);
+	if ((fail = playbg_failure_find(name, language, hash))) {
+		if (now < fail->retry)
+			res = 1;
+		else
+			fail->retry = now + MIN(1 << MIN(fail->failures, 16), PLAYBG_FAILURE_MAX_BACKOFF);
+	}
+	ast_mutex_unlock(&playbg_failure_lock);
+
+	if (res)
+		playbg_count(PLAYBG_CNT_OPEN_SKIPPED);
+	return res;
+}
+
+
+static void playbg_failure(const char *name, const char *language)
+{
+	unsigned int hash = playbg_hash(name, language, 0);
+	struct playbg_failure *fail;
+	time_t now = time(NULL);
+	int failures = 0, suppressed = 0, backoff = 0;
+
+	playbg_count(PLAYBG_CNT_OPEN_FAILED);
+
+	ast_mutex_lock(&playbg_failure_lock);
+	if (!(fail = playbg_failure_find(name, language, hash)) && (fail = ast_calloc(1, sizeof(*fail)))) {
+		fail->name = ast_strdup(name);
+		fail->language = ast_strdup(language);
+		fail->hash = hash;
+		if (!fail->name || !fail->language) {
+			playbg_failure_free(fail);
+			fail = NULL;
+		} else {
+			AST_LIST_INSERT_HEAD(&playbg_failures[hash % PLAYBG_RESOLVE_BUCKETS], fail, list);
+			playbg_nfailures++;
+		}
+	}
+	if (fail) {
+		fail->failures++;
+		backoff = MIN(1 << MIN(fail->failures - 1, 16), PLAYBG_FAILURE_MAX_BACKOFF);
+		fail->retry = now + backoff;
+		if (now - fail->logged >= PLAYBG_FAILURE_LOG_INTERVAL) {
+			fail->logged = now;
+			failures = fail->failures;
+			suppressed = fail->suppressed;
+			fail->suppressed = 0;
+		} else {
+			fail->suppressed++;
+		}
+	}
+	ast_mutex_unlock(&playbg_failure_lock);
+
+	/* so the file showing up clears the failure */
+	if (strncmp(name, "bank:", 5)) {
+		char lname[PATH_MAX];
+
+		playbg_resolve_watch(name);
+		if (name[0] != '/' && !ast_strlen_zero(language) && snprintf(lname, sizeof(lname), "%s/%s", language, name) < sizeof(lname))
+			playbg_resolve_watch(lname);
+	}
+
+	if (!fail) {
+		ast_log(LOG_WARNING, "Unable to open file '%s'\n", name);
+	} else if (failures) {
+		ast_log(LOG_WARNING, "Unable to open file '%s' (%d failures, %d not logged), next try in %d seconds\n",
+			name, failures, suppressed, backoff);
+	}
+}
+
+
+static void playbg_failure_clear(const char *name, const char *language)
+{
+	unsigned int hash;
+	struct playbg_failure *fail = NULL;
+
+	if (!playbg_nfailures)
+		return;
+
+	hash = playbg_hash(name, language, 0);
+	ast_mutex_lock(&playbg_failure_lock);
+	AST_LIST_TRAVERSE_SAFE_BEGIN(&playbg_failures[hash % PLAYBG_RESOLVE_BUCKETS], fail, list) {
+		if (fail->hash == hash && !strcmp(fail->name, name) && !strcmp(fail->language, language)) {
+			AST_LIST_REMOVE_CURRENT(&playbg_failures[hash % PLAYBG_RESOLVE_BUCKETS], list);
+			playbg_nfailures--;
+			break;
+		}
+	}
+	AST_LIST_TRAVERSE_SAFE_END
+	ast_mutex_unlock(&playbg_failure_lock);
+
+	if (fail) {
+		if (option_verbose > 2)
+			ast_verbose(VERBOSE_PREFIX_3 "PlayBG file '%s' is back after %d failures\n", name, fail->failures);
+		playbg_failure_free(fail);
+	}
+}
+
+
+/*! \brief Watch the directory holding \a path (relative to the sounds directory unless absolute) */
+static void playbg_resolve_watch(const char *path)
+{
+	struct playbg_watch *w;
+	char dir[PATH_MAX];
+	int wd;
+
+	if (playbg_inotify_fd < 0)
+		return;
+	playbg_resolve_dir(path, dir, sizeof(dir));
+
+	ast_mutex_lock(&playbg_watch_lock);
+	AST_LIST_TRAVERSE(&playbg_watches, w, list) {
+		if (!strcmp(w->dir, dir))
+			break;
+	}
+	if (!w && (wd = inotify_add_watch(playbg_inotify_fd, dir, IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO
+	    | IN_CLOSE_WRITE | IN_DELETE_SELF | IN_MOVE_SELF)) >= 0 && (w = ast_calloc(1, sizeof(*w)))) {
+		w->wd = wd;
+		if ((w->dir = ast_strdup(dir)))
+			AST_LIST_INSERT_HEAD(&playbg_watches, w, list);
+		else
+			ast_free(w);
+	}
+	ast_mutex_unlock(&playbg_watch_lock);
+}
+
+
+/*! \brief Directory of an inotify watch, copied to dir */
+static int playbg_watch_dir(int wd, int removed, char *dir, size_t len)
+{
+	struct playbg_watch *w;
+
+	ast_mutex_lock(&playbg_watch_lock);
+	AST_LIST_TRAVERSE_SAFE_BEGIN(&playbg_watches, w, list) {
+		if (w->wd != wd)
+			continue;
+		ast_copy_string(dir, w->dir, len);
+		if (removed) {
+			AST_LIST_REMOVE_CURRENT(&playbg_watches, list);
+			ast_free(w->dir);
+			ast_free(w);
+		}
+		break;
+	}
+	AST_LIST_TRAVERSE_SAFE_END
+	ast_mutex_unlock(&playbg_watch_lock);
+	return w ? 0 : -1;
+}
+
+
+static void playbg_watch_flush(void)
+{
+	struct playbg_watch *w;
+
+	ast_mutex_lock(&playbg_watch_lock);
+	while ((w = AST_LIST_REMOVE_HEAD(&playbg_watches, list))) {
+		ast_free(w->dir);
+		ast_free(w);
+	}
+	ast_mutex_unlock(&playbg_watch_lock);
+}
+
+
+static void *playbg_inotify_run(void *data)
+{
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	struct pollfd pfd = { .fd = playbg_inotify_fd, .events = POLLIN };
+	const struct inotify_event *ev;
+	char dir[PATH_MAX];
+	ssize_t len;
+	char *c;
+
+	while (!playbg_inotify_stop) {
+		if (poll(&pfd, 1, 1000) <= 0)
+			continue;
+		if ((len = read(playbg_inotify_fd, buf, sizeof(buf))) <= 0)
+			continue;
+		for (c = buf; c < buf + len; c += sizeof(*ev) + ev->len) {
+			ev = (const struct inotify_event *) c;
+			if (ev->mask & IN_Q_OVERFLOW) {
+				/* events were lost, anything may have changed */
+				playbg_resolve_flush();
+				playbg_failure_flush();
+				playbg_index_flush();
+			} else if (!playbg_watch_dir(ev->wd, ev->mask & IN_IGNORED, dir, sizeof(dir))) {
+				playbg_resolve_flush_dir(dir);
+				playbg_failure_flush_dir(dir);
+				playbg_index_flush_dir(dir);
+			}
+		}
+	}
+	return NULL;
+}
+
+
+static void playbg_inotify_start(void)
+{
+	if ((playbg_inotify_fd = inotify_init()) < 0) {
+		ast_log(LOG_NOTICE, "inotify unavailable (%s), file resolutions expire after %d seconds\n", strerror(errno), PLAYBG_RESOLVE_TTL);
+		return;
+	}
+	fcntl(playbg_inotify_fd, F_SETFL, O_NONBLOCK);
+	playbg_inotify_stop = 0;
+	if (ast_pthread_create_background(&playbg_inotify_thread, NULL, playbg_inotify_run, NULL)) {
+		ast_log(LOG_WARNING, "Unable to start playbg inotify thread\n");
+		close(playbg_inotify_fd);
+		playbg_inotify_fd = -1;
+		playbg_inotify_thread = AST_PTHREADT_NULL;
+	}
+}
+
+
+static void playbg_inotify_shutdown(void)
+{
+	if (playbg_inotify_thread != AST_PTHREADT_NULL) {
+		playbg_inotify_stop = 1;
+		pthread_join(playbg_inotify_thread, NULL);
+		playbg_inotify_thread = AST_PTHREADT_NULL;
+	}
+	if (playbg_inotify_fd > -1) {
+		close(playbg_inotify_fd);
+		playbg_inotify_fd = -1;
+	}
+	playbg_watch_flush();
+}
+
+
+/*! \brief playbg_resolve() through the resolution cache */
+static int playbg_resolve_cached(const char *name, const char *language, int prefs, struct playbg_resolved *res)
+{
+	unsigned int hash = playbg_hash(name, language, prefs);
+	struct playbg_resolution *r;
+	time_t now = time(NULL);
+	int found = 0;
+
+	ast_mutex_lock(&playbg_resolve_lock);
+	AST_LIST_TRAVERSE_SAFE_BEGIN(&playbg_resolutions[hash % PLAYBG_RESOLVE_BUCKETS], r, list) {
+		if (r->hash != hash || r->prefs != prefs || strcmp(r->name, name) || strcmp(r->language, language))
+			continue;
+		if (playbg_inotify_fd < 0 && now - r->created > PLAYBG_RESOLVE_TTL) {
+			AST_LIST_REMOVE_CURRENT(&playbg_resolutions[hash % PLAYBG_RESOLVE_BUCKETS], list);
+			playbg_resolution_free(r);
+			break;
+		}
+		ast_copy_string(res->path, r->path, sizeof(res->path));
+		ast_copy_string(res->ext, r->ext, sizeof(res->ext));
+		res->format = r->format;
+		found = 1;
+		break;
+	}
+	AST_LIST_TRAVERSE_SAFE_END
+	ast_mutex_unlock(&playbg_resolve_lock);
+	if (found)
+		return 0;
+
+	if (playbg_resolve(name, language, prefs, res))
+		return -1;
+
+	if (!(r = ast_calloc(1, sizeof(*r))))
+		return 0;
+	r->name = ast_strdup(name);
+	r->language = ast_strdup(language);
+	r->path = ast_strdup(res->path);
+	if (!r->name || !r->language || !r->path) {
+		playbg_resolution_free(r);
+		return 0;
+	}
+	r->prefs = prefs;
+	r->hash = hash;
+	r->created = now;
+	ast_copy_string(r->ext, res->ext, sizeof(r->ext));
+	r->format = res->format;
+
+	/* a new file in the directory it came from, or in a better language, changes the answer */
+	playbg_resolve_watch(name);
+	playbg_resolve_watch(res->path);
+
+	ast_mutex_lock(&playbg_resolve_lock);
+	AST_LIST_INSERT_HEAD(&playbg_resolutions[hash % PLAYBG_RESOLVE_BUCKETS], r, list);
+	ast_mutex_unlock(&playbg_resolve_lock);
+	return 0;
+}
+
+#endif /* _PLAYBG_RESOLVE_H */
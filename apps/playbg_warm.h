@@ -0,0 +1,443 @@
+/*
+ * See http://www.asterisk.org for more information about
+ * the Asterisk project. Please do not directly contact
+ * any of the maintainers of this project for assistance;
+ * the project provides a web site, mailing lists and IRC
+ * channels for your use.
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+*/
+
+/*! \file
+ *
+ * \brief Cache reload and warm set of app_playbg
+ */
+
+#ifndef _PLAYBG_WARM_H
+#define _PLAYBG_WARM_H
+
+/* Cache reload */
+static pthread_t playbg_reload_thread = AST_PTHREADT_NULL;
+static int playbg_reload_running;
+struct playbg_reload_stats {
+	time_t when;
+	int checked;
+	int swapped;
+	int removed;
+};
+
+/*! \brief The last reload done, under playbg_cache_lock */
+static struct playbg_reload_stats playbg_reload_last;
+
+
+static void *playbg_reload_run(void *data)
+{
+	struct playbg_reload_stats last = { 0, };
+	struct playbg_audio **all, *audio, *fresh;
+	int i, n = 0, max = 0, res;
+
+	/* fresh resolutions, and durations once the files are swapped */
+	playbg_resolve_flush();
+	playbg_failure_flush();
+	playbg_bank_flush();
+
+	ast_mutex_lock(&playbg_cache_lock);
+	for (i = 0; i < PLAYBG_CACHE_BUCKETS; i++) {
+		AST_LIST_TRAVERSE(&playbg_cache[i], audio, list)
+			max++;
+	}
+	if ((all = ast_calloc(max + 1, sizeof(*all)))) {
+		for (i = 0; i < PLAYBG_CACHE_BUCKETS; i++) {
+			AST_LIST_TRAVERSE(&playbg_cache[i], audio, list)
+				all[n++] = playbg_audio_ref(audio);
+		}
+	}
+	ast_mutex_unlock(&playbg_cache_lock);
+
+	last.when = time(NULL);
+	for (i = 0; i < n; i++) {
+		audio = all[i];
+		last.checked++;
+		if (playbg_audio_changed(audio)) {
+			if (!strncmp(audio->name, "bank:", 5))
+				fresh = playbg_bank_decode(audio->name, audio->language, audio->rate, audio->normalized);
+			else
+				fresh = playbg_audio_decode(audio->name, audio->language, audio->rate, audio->normalized);
+			if ((res = playbg_cache_swap(audio, fresh)) >= 0) {
+				if (!res)
+					last.swapped++;
+				else
+					last.removed++;
+				if (option_verbose > 2)
+					ast_verbose(VERBOSE_PREFIX_3 "PlayBG reload: %s '%s' (%s, %d Hz)\n", res ? "dropped" : "updated",
+						audio->name, audio->language, audio->rate);
+			}
+			if (res && fresh)
+				playbg_audio_unref(fresh);
+		}
+		playbg_audio_unref(audio);
+	}
+	if (all)
+		ast_free(all);
+	playbg_index_flush();
+
+	ast_mutex_lock(&playbg_cache_lock);
+	playbg_reload_last = last;
+	ast_mutex_unlock(&playbg_cache_lock);
+	if (option_verbose > 1)
+		ast_verbose(VERBOSE_PREFIX_2 "PlayBG reload done: %d cached files checked, %d updated, %d dropped\n",
+			last.checked, last.swapped, last.removed);
+	playbg_reload_running = 0;
+	return NULL;
+}
+
+
+/*! \brief Start a cache reload, unless one is running */
+static int playbg_reload_start(void)
+{
+	if (ast_atomic_fetchadd_int(&playbg_reload_running, 1))
+		return -1;
+	if (playbg_reload_thread != AST_PTHREADT_NULL)
+		pthread_join(playbg_reload_thread, NULL);
+	if (ast_pthread_create_background(&playbg_reload_thread, NULL, playbg_reload_run, NULL)) {
+		playbg_reload_thread = AST_PTHREADT_NULL;
+		playbg_reload_running = 0;
+		return -1;
+	}
+	return 0;
+}
+
+
+static void playbg_reload_shutdown(void)
+{
+	if (playbg_reload_thread != AST_PTHREADT_NULL) {
+		pthread_join(playbg_reload_thread, NULL);
+		playbg_reload_thread = AST_PTHREADT_NULL;
+	}
+}
+
+
+/*! \brief Take the current version of a file playbg reload replaced */
+static void playbg_state_refresh(struct playbg_state *state, struct ast_channel *chan, int pos)
+{
+	struct playbg_audio *old = state->audio[pos];
+
+	/* no current version yet is no switch, the file goes to disk */
+	if ((state->audio[pos] = playbg_cache_lookup(state->filearray[pos], chan->language, state->chanrate, state->normalize)))
+		playbg_count(PLAYBG_CNT_RELOAD_SWITCHES);
+	playbg_audio_unref(old);
+}
+
+
+/* Warm set */
+#define PLAYBG_WARM_BUCKETS 256
+#define PLAYBG_WARM_MAX 4096		/* files tracked */
+
+struct playbg_warm {
+	char *name;
+	char *language;
+	unsigned int hash;
+	int rate;
+	int normalize;
+	int plays;
+	time_t last;
+	int warmed;			/*!< loaded by the warm-up */
+	double score;			/*!< for sorting, at dump time */
+	AST_LIST_ENTRY(playbg_warm) list;
+};
+
+static AST_LIST_HEAD_NOLOCK(playbg_warm_bucket, playbg_warm) playbg_warm_table[PLAYBG_WARM_BUCKETS];
+AST_MUTEX_DEFINE_STATIC(playbg_warm_lock);
+static int playbg_warm_count;
+static int playbg_warm_plays;		/*!< files started since load */
+static int playbg_warm_hits;		/*!< of which warmed ones */
+
+/*! \brief How the last warm-up went, under playbg_warm_lock */
+struct playbg_warmup {
+	time_t started;
+	int64_t elapsed;		/*!< ms, -1 while running */
+	int files;			/*!< in warmfile */
+	int cached;
+	int hinted;
+	int failed;
+};
+
+static struct playbg_warmup playbg_warmup = { .elapsed = -1 };
+
+static pthread_t playbg_warm_thread = AST_PTHREADT_NULL;
+static ast_cond_t playbg_warm_cond;		/*!< wakes the thread up to stop */
+static volatile int playbg_warm_stop;
+
+
+/*! \brief Find or add the entry of a file, with playbg_warm_lock held */
+static struct playbg_warm *playbg_warm_find(const char *name, const char *language, int rate, int normalize)
+{
+	unsigned int hash = playbg_hash(name, language, rate);
+	struct playbg_warm *w;
+
+	AST_LIST_TRAVERSE(&playbg_warm_table[hash % PLAYBG_WARM_BUCKETS], w, list) {
+		if (w->hash == hash && w->rate == rate && w->normalize == normalize
+		    && !strcmp(w->name, name) && !strcmp(w->language, language))
+			return w;
+	}
+	if (playbg_warm_count >= PLAYBG_WARM_MAX || !(w = ast_calloc(1, sizeof(*w))))
+		return NULL;
+	if (!(w->name = ast_strdup(name)) || !(w->language = ast_strdup(language))) {
+		if (w->name)
+			ast_free(w->name);
+		ast_free(w);
+		return NULL;
+	}
+	w->hash = hash;
+	w->rate = rate;
+	w->normalize = normalize;
+	AST_LIST_INSERT_HEAD(&playbg_warm_table[hash % PLAYBG_WARM_BUCKETS], w, list);
+	playbg_warm_count++;
+	return w;
+}
+
+
+/*! \brief Count a file a channel starts playing */
+static void playbg_warm_played(const char *name, const char *language, int rate, int normalize)
+{
+	struct playbg_warm *w;
+
+	if (!playbg_warm_set || ast_strlen_zero(name) || rate <= 0)
+		return;
+	ast_mutex_lock(&playbg_warm_lock);
+	if ((w = playbg_warm_find(name, language, rate, normalize))) {
+		w->plays++;
+		w->last = time(NULL);
+		playbg_warm_hits += w->warmed;
+	}
+	playbg_warm_plays++;
+	ast_mutex_unlock(&playbg_warm_lock);
+}
+
+
+/*! \brief Where the warm set is kept, -1 if that does not fit in len */
+static int playbg_warm_path(char *fn, size_t len)
+{
+	if (playbg_warm_file[0] == '/')
+		return snprintf(fn, len, "%s", playbg_warm_file) < len ? 0 : -1;
+	return snprintf(fn, len, "%s/%s", ast_config_AST_VAR_DIR, playbg_warm_file) < len ? 0 : -1;
+}
+
+
+static int playbg_warm_compare(const void *a, const void *b)
+{
+	double sa = (*(struct playbg_warm * const *) a)->score, sb = (*(struct playbg_warm * const *) b)->score;
+
+	return sa < sb ? 1 : sa > sb ? -1 : 0;
+}
+
+
+/*! \brief The best scoring entries, best first */
+static struct playbg_warm **playbg_warm_best(int max, int *n)
+{
+	struct playbg_warm **all, *w;
+	time_t now = time(NULL);
+	int i;
+
+	*n = 0;
+	if (!(all = ast_calloc(playbg_warm_count + 1, sizeof(*all))))
+		return NULL;
+	for (i = 0; i < PLAYBG_WARM_BUCKETS; i++) {
+		AST_LIST_TRAVERSE(&playbg_warm_table[i], w, list) {
+			if (!w->plays)
+				continue;
+			w->score = w->plays * exp2(-(double) (now - w->last) / 86400);
+			all[(*n)++] = w;
+		}
+	}
+	qsort(all, *n, sizeof(*all), playbg_warm_compare);
+	*n = MIN(*n, max);
+	return all;
+}
+
+
+/*! \brief Write the warm set, under a temporary name renamed into place */
+static void playbg_warm_dump(void)
+{
+	struct playbg_warm **best;
+	char fn[PATH_MAX], tmp[PATH_MAX + 16];
+	FILE *f;
+	int i, n, res;
+
+	if (playbg_warm_path(fn, sizeof(fn))) {
+		ast_log(LOG_WARNING, "playbg warm set path too long\n");
+		return;
+	}
+	snprintf(tmp, sizeof(tmp), "%s.tmp", fn);
+	if (!(f = fopen(tmp, "w"))) {
+		ast_log(LOG_WARNING, "Unable to write playbg warm set '%s': %s\n", tmp, strerror(errno));
+		return;
+	}
+	ast_mutex_lock(&playbg_warm_lock);
+	if ((best = playbg_warm_best(playbg_warm_size, &n))) {
+		for (i = 0; i < n; i++) {
+			fprintf(f, "%d %ld %d %d %s %s\n", best[i]->plays, (long) best[i]->last, best[i]->rate,
+				best[i]->normalize, ast_strlen_zero(best[i]->language) ? "-" : best[i]->language, best[i]->name);
+		}
+		ast_free(best);
+	}
+	ast_mutex_unlock(&playbg_warm_lock);
+	res = ferror(f);
+	if (fclose(f) || res || rename(tmp, fn)) {
+		ast_log(LOG_WARNING, "Unable to write playbg warm set '%s'\n", fn);
+		unlink(tmp);
+	} else if (option_debug > 2) {
+		ast_log(LOG_DEBUG, "Wrote %d files to playbg warm set '%s'\n", n, fn);
+	}
+}
+
+
+/*! \brief Bring one file of the warm set in, from the warm-up thread */
+static void playbg_warm_file_load(const char *name, const char *language, int rate, int normalize)
+{
+	struct playbg_resolved res;
+	struct playbg_audio *audio;
+	char fn[PATH_MAX + 64];
+	int *count;
+
+	if ((audio = playbg_cache_get(name, language, rate, normalize))) {
+		playbg_audio_unref(audio);
+		count = &playbg_warmup.cached;
+	} else if (strncmp(name, "bank:", 5) && !playbg_resolve_cached(name, language, 0, &res)) {
+		playbg_resolved_file(&res, fn, sizeof(fn));
+		playbg_hint_file(fn, POSIX_FADV_WILLNEED, 0);
+		count = &playbg_warmup.hinted;
+	} else {
+		count = &playbg_warmup.failed;
+	}
+	ast_mutex_lock(&playbg_warm_lock);
+	(*count)++;
+	ast_mutex_unlock(&playbg_warm_lock);
+}
+
+
+/*! \brief Read warmfile back, counts and all, loading each file in turn */
+static void playbg_warm_load(void)
+{
+	struct playbg_warm *w;
+	char fn[PATH_MAX], line[PATH_MAX + 128], language[MAX_LANGUAGE], format[64];
+	long last;
+	int plays, rate, normalize, end, n;
+	struct timeval start = ast_tvnow();
+	struct playbg_warmup done;
+	FILE *f;
+
+	ast_mutex_lock(&playbg_warm_lock);
+	playbg_warmup.started = time(NULL);
+	ast_mutex_unlock(&playbg_warm_lock);
+	if (playbg_warm_path(fn, sizeof(fn)) || !(f = fopen(fn, "r"))) {
+		if (option_debug)
+			ast_log(LOG_DEBUG, "No playbg warm set '%s' yet\n", fn);
+		ast_mutex_lock(&playbg_warm_lock);
+		playbg_warmup.elapsed = 0;
+		ast_mutex_unlock(&playbg_warm_lock);
+		return;
+	}
+	/* the file is only ever ours, but a bad line must not overrun language */
+	snprintf(format, sizeof(format), "%%d %%ld %%d %%d %%%ds%%n %%n", MAX_LANGUAGE - 1);
+	while (!playbg_warm_stop && fgets(line, sizeof(line), f)) {
+		line[strcspn(line, "\n")] = '\0';
+		n = 0;
+		if (sscanf(line, format, &plays, &last, &rate, &normalize, language, &end, &n) < 5 || !n || !line[n])
+			continue;
+		if ((line[end] != ' ' && line[end] != '\t') || (rate != 8000 && rate != 16000 && rate != 32000 && rate != 48000)
+		    || (normalize != 0 && normalize != 1)) {
+			if (option_debug)
+				ast_log(LOG_DEBUG, "Skipping bad line in playbg warm set '%s': %s\n", fn, line);
+			continue;
+		}
+		if (!strcmp(language, "-"))
+			language[0] = '\0';
+		ast_mutex_lock(&playbg_warm_lock);
+		playbg_warmup.files++;
+		if ((w = playbg_warm_find(line + n, language, rate, normalize))) {
+			w->plays += plays;
+			w->last = MAX(w->last, (time_t) last);
+			w->warmed = 1;
+		}
+		ast_mutex_unlock(&playbg_warm_lock);
+		playbg_warm_file_load(line + n, language, rate, normalize);
+	}
+	fclose(f);
+	ast_mutex_lock(&playbg_warm_lock);
+	playbg_warmup.elapsed = ast_tvdiff_ms(ast_tvnow(), start);
+	done = playbg_warmup;
+	ast_mutex_unlock(&playbg_warm_lock);
+	if (option_verbose > 2)
+		ast_verbose(VERBOSE_PREFIX_3 "PlayBG warm set loaded in %lld ms: %d files, %d cached, %d hinted, %d failed\n",
+			(long long) done.elapsed, done.files, done.cached, done.hinted, done.failed);
+}
+
+
+static void *playbg_warm_run(void *data)
+{
+	struct timespec ts = { 0, 0 };
+
+	playbg_warm_load();
+	ast_mutex_lock(&playbg_warm_lock);
+	while (!playbg_warm_stop) {
+		ts.tv_sec = time(NULL) + playbg_warm_interval;
+		while (!playbg_warm_stop && ast_cond_timedwait(&playbg_warm_cond, &playbg_warm_lock, &ts) != ETIMEDOUT)
+			;
+		if (playbg_warm_stop)
+			break;
+		ast_mutex_unlock(&playbg_warm_lock);
+		playbg_warm_dump();
+		ast_mutex_lock(&playbg_warm_lock);
+	}
+	ast_mutex_unlock(&playbg_warm_lock);
+	return NULL;
+}
+
+
+static void playbg_warm_start(void)
+{
+	if (!playbg_warm_set || playbg_warm_thread != AST_PTHREADT_NULL)
+		return;
+	playbg_warm_stop = 0;
+	ast_cond_init(&playbg_warm_cond, NULL);
+	if (ast_pthread_create_background(&playbg_warm_thread, NULL, playbg_warm_run, NULL)) {
+		ast_log(LOG_WARNING, "Unable to start playbg warm-up thread\n");
+		playbg_warm_thread = AST_PTHREADT_NULL;
+		ast_cond_destroy(&playbg_warm_cond);
+	}
+}
+
+
+/*! \brief Stop the thread, write the set a last time and forget it */
+static void playbg_warm_shutdown(void)
+{
+	struct playbg_warm *w;
+	int i;
+
+	if (playbg_warm_thread == AST_PTHREADT_NULL)
+		return;
+	ast_mutex_lock(&playbg_warm_lock);
+	playbg_warm_stop = 1;
+	ast_cond_signal(&playbg_warm_cond);
+	ast_mutex_unlock(&playbg_warm_lock);
+	pthread_join(playbg_warm_thread, NULL);
+	playbg_warm_thread = AST_PTHREADT_NULL;
+	ast_cond_destroy(&playbg_warm_cond);
+	playbg_warm_dump();
+
+	ast_mutex_lock(&playbg_warm_lock);
+	for (i = 0; i < PLAYBG_WARM_BUCKETS; i++) {
+		while ((w = AST_LIST_REMOVE_HEAD(&playbg_warm_table[i], list))) {
+			ast_free(w->name);
+			ast_free(w->language);
+			ast_free(w);
+		}
+	}
+	playbg_warm_count = 0;
+	ast_mutex_unlock(&playbg_warm_lock);
+}
+
+#endif /* _PLAYBG_WARM_H */
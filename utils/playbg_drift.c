@@ -0,0 +1,206 @@
+/*
+ * See http://www.asterisk.org for more information about
+ * the Asterisk project. Please do not directly contact
+ * any of the maintainers of this project for assistance;
+ * the project provides a web site, mailing lists and IRC
+ * channels for your use.
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+*/
+
+/*! \file
+ *
+ * \brief Check playbg pacing for drift over a simulated day
+ *
+ * playbg_drift [hours]
+ *
+ * Runs the generator loop of app_playbg, playbg_pace_run(), against a
+ * simulated clock and playlist: calls every 20 ms with 15 to 25 ms of
+ * jitter, a short request now and then, and a stall of a second every
+ * hour that maxburst cuts down and the skip policy steps over.
+ *
+ * The playlist mixes what the frame builders really hand out: cached
+ * files in ptime frames with a short last one, smoothed streams with a
+ * padded tail, native files at another rate read in frames of any
+ * length down to one sample, and gaps of silence, sent, suppressed as
+ * DTX does, or missing in a codec that has none. The position played,
+ * exactly, plus what was skipped and what is queued is compared to the
+ * time elapsed at every call. Exits 1 if they ever differ by a sample
+ * or more at the channel rate.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../apps/playbg_pace.h"
+
+#define CALL_MS 20			/* what the core asks for */
+#define STALL_US 1000000
+#define MAX_BURST 5			/* frames */
+#define EXACT_RATE 48000		/* positions are kept exactly in these ticks */
+
+static const int rates[] = { 8000, 16000 };
+static const int ptimes[] = { 20, 30, 60 };
+
+enum {
+	SEG_CACHED,			/* chanrate, ptime frames, short last frame */
+	SEG_SMOOTHED,			/* chanrate, ptime frames, tail padded */
+	SEG_NATIVE,			/* srcrate, frames of any length */
+	SEG_SILENCE,			/* chanrate, ptime frames, may be missing */
+	SEG_KINDS
+};
+
+struct sim {
+	struct playbg_pacer *pacer;
+	int chanrate;
+	int frame;			/*!< ptime at chanrate */
+	int kind;
+	int srcrate;
+	int left;			/*!< samples left in the segment, at srcrate */
+	int missing;			/*!< silence the codec has none of */
+	int built;			/*!< samples of the frame built, at srcrate */
+	int silent;			/*!< silent frames in a row */
+	int carry;			/*!< convert without carry, to see the check fail */
+	int64_t exact;			/*!< position played, in EXACT_RATE ticks */
+	int64_t sent;			/*!< EXACT_RATE ticks */
+	int64_t suppressed;		/*!< EXACT_RATE ticks */
+	int64_t skipped;		/*!< samples at chanrate */
+};
+
+
+static void sim_segment(struct sim *sim)
+{
+	sim->kind = rand() % SEG_KINDS;
+	sim->srcrate = sim->kind == SEG_NATIVE ? rates[rand() % 2] : sim->chanrate;
+	sim->left = 1 + rand() % (sim->srcrate * 10);
+	sim->missing = sim->kind == SEG_SILENCE && rand() % 2;
+	if (sim->kind == SEG_SMOOTHED)
+		sim->left += sim->frame - sim->left % sim->frame;
+}
+
+
+static int sim_next(void *data)
+{
+	struct sim *sim = data;
+	int n;
+
+	if (!sim->left)
+		sim_segment(sim);
+	if (sim->kind == SEG_NATIVE)
+		n = 1 + rand() % (2 * sim->srcrate * CALL_MS / 1000);
+	else
+		n = sim->frame;
+	n = sim->built = n < sim->left ? n : sim->left;
+	sim->left -= n;
+	sim->exact += (int64_t) n * (EXACT_RATE / sim->srcrate);
+	if (!sim->carry)
+		return n * sim->chanrate / sim->srcrate;
+	return playbg_pacer_convert(sim->pacer, n, sim->srcrate, sim->chanrate);
+}
+
+
+static int sim_send(void *data)
+{
+	struct sim *sim = data;
+
+	if (sim->kind == SEG_SILENCE) {
+		/* the first silent frame still goes out */
+		if (sim->missing || sim->silent++ >= 1) {
+			sim->suppressed += (int64_t) sim->built * (EXACT_RATE / sim->srcrate);
+			return 0;
+		}
+	} else {
+		sim->silent = 0;
+	}
+	sim->sent += (int64_t) sim->built * (EXACT_RATE / sim->srcrate);
+	return 0;
+}
+
+
+static void sim_overrun(void *data, int excess)
+{
+	struct sim *sim = data;
+
+	sim->skipped += excess;
+}
+
+
+static const struct playbg_pace_ops sim_ops = {
+	.next = sim_next,
+	.send = sim_send,
+	.overrun = sim_overrun,
+};
+
+
+/*!
+ * \brief Run the generator for duration usec
+ * \return the largest difference between position and elapsed time, in EXACT_RATE ticks
+ */
+static int64_t drift(int rate, int ptime, int pacing, int carry, int64_t duration, int64_t *end)
+{
+	struct playbg_pacer pacer = { 0, };
+	struct sim sim = { 0, };
+	int64_t now = 1000000, first, elapsed = 0, position, diff, worst = 0;
+	int asked = rate * CALL_MS / 1000;
+	int tick = EXACT_RATE / rate;
+	int queue = 0;
+	long calls;
+
+	srand(rate * ptime);
+	sim.pacer = &pacer;
+	sim.chanrate = rate;
+	sim.frame = rate * ptime / 1000;
+	sim.carry = carry;
+	/* the first call is a core frame ahead of the clock */
+	first = now - (int64_t) asked * 1000000 / rate;
+	playbg_pace_run(&pacer, &queue, pacing, now, rate, asked, MAX_BURST * sim.frame, &sim_ops, &sim);
+	for (calls = 1; now - first < duration; calls++) {
+		now += (CALL_MS - 5) * 1000 + rand() % 10001;
+		if (calls % (3600 * 1000 / CALL_MS) == 0)
+			now += STALL_US;
+		/* the core's own frame came up short */
+		asked = rate * CALL_MS / 1000 / (calls % 97 ? 1 : 3);
+		if (playbg_pace_run(&pacer, &queue, pacing, now, rate, asked, MAX_BURST * sim.frame, &sim_ops, &sim)) {
+			printf("generator failed\n");
+			exit(2);
+		}
+
+		elapsed = (now - first) * EXACT_RATE / 1000000;
+		position = sim.exact + (sim.skipped + queue) * tick;
+		diff = position > elapsed ? position - elapsed : elapsed - position;
+		if (diff > worst)
+			worst = diff;
+	}
+	*end = sim.exact + (sim.skipped + queue) * tick - elapsed;
+	if (pacing && carry)
+		printf("%5d Hz %2d ms: %ld calls, %lld s sent, %lld s suppressed, %lld skipped, worst %.2f samples off",
+			rate, ptime, calls, (long long) (sim.sent / EXACT_RATE), (long long) (sim.suppressed / EXACT_RATE),
+			(long long) sim.skipped, (double) worst / tick);
+	return worst;
+}
+
+
+int main(int argc, char *argv[])
+{
+	int64_t duration = (int64_t) (argc > 1 ? atoi(argv[1]) : 24) * 3600 * 1000000;
+	int64_t end, uncarried, unpaced;
+	int i, j, res = 0;
+
+	for (i = 0; i < (int) (sizeof(rates) / sizeof(rates[0])); i++) {
+		for (j = 0; j < (int) (sizeof(ptimes) / sizeof(ptimes[0])); j++) {
+			int tick = EXACT_RATE / rates[i];
+
+			if (drift(rates[i], ptimes[j], 1, 1, duration, &end) >= tick) {
+				printf("\n%5d Hz %2d ms: drifted by a sample or more\n", rates[i], ptimes[j]);
+				res = 1;
+				continue;
+			}
+			drift(rates[i], ptimes[j], 1, 0, duration, &uncarried);
+			drift(rates[i], ptimes[j], 0, 1, duration, &unpaced);
+			printf("; %lld off without carry, %lld without pacing\n", (long long) (uncarried / tick), (long long) (unpaced / tick));
+		}
+	}
+	return res;
+}
@@ -0,0 +1,155 @@
+/*
+ * See http://www.asterisk.org for more information about
+ * the Asterisk project. Please do not directly contact
+ * any of the maintainers of this project for assistance;
+ * the project provides a web site, mailing lists and IRC
+ * channels for your use.
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+*/
+
+/*! \file
+ *
+ * \brief Compare frame reads from normal and huge page backed audio
+ *
+ * playbg_huge [MB] [channels]
+ *
+ * Fills MB megabytes (default 1024) of signed linear, the way the cache
+ * holds decoded audio, once with madvise(MADV_NOHUGEPAGE) and once with
+ * madvise(MADV_HUGEPAGE) as hugepages=transparent does. Then channels
+ * (default 4000), each at a random position, read a 20 ms frame in
+ * turn, as generators do. Prints ns per frame and, where perf events
+ * are allowed, dTLB load misses per frame, and how much of the memory
+ * the kernel did back with huge pages.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#define FRAME 160			/* samples */
+#define HUGE (2 << 20)
+#define ROUNDS 200
+
+static int64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+/*! \brief Counter of dTLB load misses in user space, -1 if not allowed */
+static int tlb_counter(void)
+{
+	struct perf_event_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = PERF_TYPE_HW_CACHE;
+	attr.config = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+	attr.disabled = 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	return syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+
+/*! \brief AnonHugePages of this process, in kB */
+static long huge_kb(void)
+{
+	char line[256];
+	long kb = 0;
+	FILE *f;
+
+	if (!(f = fopen("/proc/self/smaps_rollup", "r")))
+		return -1;
+	while (fgets(line, sizeof(line), f)) {
+		if (sscanf(line, "AnonHugePages: %ld kB", &kb) == 1)
+			break;
+	}
+	fclose(f);
+	return kb;
+}
+
+
+static void run(size_t bytes, int nchannels, int huge)
+{
+	size_t samples = bytes / sizeof(short), *pos;
+	int64_t start, elapsed, sum = 0;
+	long long misses = -1;
+	char *map;
+	short *audio, out[FRAME];
+	int fd, r, c;
+	size_t i;
+
+	/* aligned like the module's chunks */
+	if ((map = mmap(NULL, bytes + HUGE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED) {
+		perror("mmap");
+		exit(1);
+	}
+	audio = (short *) (((uintptr_t) map + HUGE - 1) & ~((uintptr_t) HUGE - 1));
+	madvise(audio, bytes, huge ? MADV_HUGEPAGE : MADV_NOHUGEPAGE);
+	for (i = 0; i < samples; i++)
+		audio[i] = i;
+	if (!(pos = malloc(nchannels * sizeof(*pos))))
+		exit(1);
+	srand(1);
+	for (c = 0; c < nchannels; c++)
+		pos[c] = ((size_t) rand() * RAND_MAX + rand()) % (samples - FRAME);
+
+	fd = tlb_counter();
+	if (fd >= 0)
+		ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+	start = now_ns();
+	for (r = 0; r < ROUNDS; r++) {
+		for (c = 0; c < nchannels; c++) {
+			memcpy(out, audio + pos[c], sizeof(out));
+			sum += out[FRAME / 2];
+			if ((pos[c] += FRAME) > samples - FRAME)
+				pos[c] = 0;
+		}
+	}
+	elapsed = now_ns() - start;
+	if (fd >= 0) {
+		ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+		if (read(fd, &misses, sizeof(misses)) != sizeof(misses))
+			misses = -1;
+		close(fd);
+	}
+
+	printf("%-6s %4.1f ns per frame, ", huge ? "huge" : "normal", (double) elapsed / ROUNDS / nchannels);
+	if (misses >= 0)
+		printf("%.3f dTLB misses per frame, ", (double) misses / ROUNDS / nchannels);
+	else
+		printf("dTLB misses not available, ");
+	printf("%ld MB in huge pages (%lld)\n", huge_kb() / 1024, (long long) (sum & 1));
+	munmap(map, bytes + HUGE);
+	free(pos);
+}
+
+
+int main(int argc, char *argv[])
+{
+	size_t bytes = (size_t) (argc > 1 ? atol(argv[1]) : 1024) << 20;
+	int nchannels = argc > 2 ? atoi(argv[2]) : 4000;
+
+	if (bytes < HUGE || nchannels <= 0) {
+		fprintf(stderr, "Usage: playbg_huge [MB] [channels]\n");
+		return 1;
+	}
+	run(bytes, nchannels, 0);
+	run(bytes, nchannels, 1);
+	return 0;
+}
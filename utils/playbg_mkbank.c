@@ -0,0 +1,275 @@
+/*
+ * See http://www.asterisk.org for more information about
+ * the Asterisk project. Please do not directly contact
+ * any of the maintainers of this project for assistance;
+ * the project provides a web site, mailing lists and IRC
+ * channels for your use.
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+*/
+
+/*! \file
+ *
+ * \brief Build a playbg sound bank from a directory of sound files
+ *
+ * playbg_mkbank <directory> <bank>
+ *
+ * Every .sln, .raw, .sln16, .sln32, .sln48, .ulaw, .pcm, .alaw, .al and
+ * 16 bit mono .wav file under <directory> becomes a member named after
+ * its path relative to it, less the extension: digits/fr/1.ulaw is
+ * digits/fr/1, played as bank:<bank>/digits/1 on a French channel, as
+ * is fr/digits/1.ulaw with languageprefix.
+ * Other files, and wavs at rates other than 8, 16, 32 or 48 kHz, are
+ * skipped. The bank is written next to its final name and renamed into
+ * place, so channels never map half a bank.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <ftw.h>
+#include <sys/stat.h>
+
+#include "../apps/playbg_bank.h"
+
+struct member {
+	struct playbg_bank_entry entry;
+	char *path;
+	long skip;			/*!< header bytes before the audio */
+};
+
+static const struct {
+	const char *ext;
+	int encoding;
+	int rate;
+} exts[] = {
+	{ "sln", PLAYBG_BANK_SLIN, 8000 },
+	{ "raw", PLAYBG_BANK_SLIN, 8000 },
+	{ "sln16", PLAYBG_BANK_SLIN, 16000 },
+	{ "sln32", PLAYBG_BANK_SLIN, 32000 },
+	{ "sln48", PLAYBG_BANK_SLIN, 48000 },
+	{ "ulaw", PLAYBG_BANK_ULAW, 8000 },
+	{ "pcm", PLAYBG_BANK_ULAW, 8000 },
+	{ "alaw", PLAYBG_BANK_ALAW, 8000 },
+	{ "al", PLAYBG_BANK_ALAW, 8000 },
+	{ "wav", PLAYBG_BANK_SLIN, 0 },		/* rate from the header */
+};
+#define NEXTS ((int) (sizeof(exts) / sizeof(exts[0])))
+
+static struct member *members;
+static int nmembers, maxmembers;
+static size_t rootlen;
+
+
+static uint32_t le32(const unsigned char *p)
+{
+	return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t) p[3] << 24;
+}
+
+
+/*! \brief Find the PCM data of a 16 bit mono wav; sets rate, returns its offset or -1 */
+static long wav_data(const char *path, uint32_t *rate, uint64_t *length)
+{
+	unsigned char buf[16];
+	FILE *f;
+	long offset = 12, res = -1;
+	uint32_t size;
+	int fmt = 0;
+
+	if (!(f = fopen(path, "rb")))
+		return -1;
+	if (fread(buf, 1, 12, f) != 12 || memcmp(buf, "RIFF", 4) || memcmp(buf + 8, "WAVE", 4))
+		goto done;
+	while (!fseek(f, offset, SEEK_SET) && fread(buf, 1, 8, f) == 8) {
+		size = le32(buf + 4);
+		if (!memcmp(buf, "fmt ", 4)) {
+			if (size < 16 || fread(buf, 1, 16, f) != 16)
+				goto done;
+			/* PCM, one channel, 16 bits */
+			if (buf[0] != 1 || buf[1] || buf[2] != 1 || buf[3] || buf[14] != 16)
+				goto done;
+			*rate = le32(buf + 4);
+			fmt = 1;
+		} else if (!memcmp(buf, "data", 4) && fmt) {
+			*length = size & ~1u;
+			res = offset + 8;
+			goto done;
+		}
+		offset += 8 + size + (size & 1);
+	}
+done:
+	fclose(f);
+	return res;
+}
+
+
+static int add_file(const char *path, const struct stat *st, int type, struct FTW *ftw)
+{
+	struct member *m;
+	const char *ext, *rel = path + rootlen;
+	int i, len;
+
+	(void) ftw;
+	if (type != FTW_F || !(ext = strrchr(path, '.')) || ext < strrchr(path, '/'))
+		return 0;
+	for (i = 0; i < NEXTS && strcmp(ext + 1, exts[i].ext); i++);
+	if (i == NEXTS)
+		return 0;
+
+	while (*rel == '/')
+		rel++;
+	if ((len = ext - rel) <= 0)
+		return 0;
+	if (len >= PLAYBG_BANK_NAME) {
+		fprintf(stderr, "%s: name too long for a bank, skipped\n", path);
+		return 0;
+	}
+
+	if (nmembers == maxmembers) {
+		maxmembers = maxmembers ? maxmembers * 2 : 256;
+		if (!(members = realloc(members, maxmembers * sizeof(*members)))) {
+			perror("realloc");
+			return -1;
+		}
+	}
+	m = &members[nmembers];
+	memset(m, 0, sizeof(*m));
+	memcpy(m->entry.name, rel, len);
+	m->entry.encoding = exts[i].encoding;
+	m->entry.rate = exts[i].rate;
+	m->entry.length = st->st_size;
+	if (!exts[i].rate && (m->skip = wav_data(path, &m->entry.rate, &m->entry.length)) < 0) {
+		fprintf(stderr, "%s: not a 16 bit mono PCM wav, skipped\n", path);
+		return 0;
+	}
+	if (!playbg_bank_format_valid(m->entry.encoding, m->entry.rate)) {
+		fprintf(stderr, "%s: %u Hz is not 8, 16, 32 or 48 kHz, skipped\n", path, m->entry.rate);
+		return 0;
+	}
+	if (!(m->path = strdup(path))) {
+		perror("strdup");
+		return -1;
+	}
+	nmembers++;
+	return 0;
+}
+
+
+static int compare(const void *a, const void *b)
+{
+	return strcmp(((const struct member *) a)->entry.name, ((const struct member *) b)->entry.name);
+}
+
+
+/*! \brief Copy a member's audio to out at its offset */
+static int copy_member(FILE *out, const struct member *m)
+{
+	char buf[65536];
+	uint64_t left = m->entry.length;
+	size_t n;
+	FILE *in;
+
+	if (!(in = fopen(m->path, "rb")) || fseek(in, m->skip, SEEK_SET) || fseek(out, m->entry.offset, SEEK_SET)) {
+		fprintf(stderr, "%s: %s\n", m->path, strerror(errno));
+		if (in)
+			fclose(in);
+		return -1;
+	}
+	while (left && (n = fread(buf, 1, left < sizeof(buf) ? left : sizeof(buf), in)) > 0) {
+		if (fwrite(buf, 1, n, out) != n)
+			break;
+		left -= n;
+	}
+	fclose(in);
+	if (left) {
+		fprintf(stderr, "%s: short read or write\n", m->path);
+		return -1;
+	}
+	return 0;
+}
+
+
+int main(int argc, char *argv[])
+{
+	struct playbg_bank_header header;
+	char tmp[4096];
+	uint64_t offset;
+	FILE *out;
+	int i;
+
+	if (argc != 3) {
+		fprintf(stderr, "Usage: %s <directory> <bank%s>\n", argv[0], PLAYBG_BANK_EXT);
+		return 1;
+	}
+	rootlen = strlen(argv[1]);
+	if (nftw(argv[1], add_file, 16, FTW_PHYS)) {
+		fprintf(stderr, "%s: %s\n", argv[1], strerror(errno));
+		return 1;
+	}
+	if (!nmembers) {
+		fprintf(stderr, "%s: no sound files found\n", argv[1]);
+		return 1;
+	}
+
+	qsort(members, nmembers, sizeof(*members), compare);
+	offset = sizeof(header) + (uint64_t) nmembers * sizeof(struct playbg_bank_entry);
+	for (i = 0; i < nmembers; i++) {
+		/* the same name in two formats: the loader needs unique names */
+		if (i && !strcmp(members[i - 1].entry.name, members[i].entry.name)) {
+			fprintf(stderr, "%s and %s make the same member, remove one\n", members[i - 1].path, members[i].path);
+			return 1;
+		}
+		offset = (offset + PLAYBG_BANK_ALIGN - 1) & ~(uint64_t) (PLAYBG_BANK_ALIGN - 1);
+		members[i].entry.offset = offset;
+		offset += members[i].entry.length;
+	}
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, PLAYBG_BANK_MAGIC, sizeof(PLAYBG_BANK_MAGIC));
+	header.version = PLAYBG_BANK_VERSION;
+	header.byteorder = PLAYBG_BANK_BYTEORDER;
+	header.count = nmembers;
+	header.size = offset;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp.%d", argv[2], (int) getpid());
+	if (!(out = fopen(tmp, "wb"))) {
+		fprintf(stderr, "%s: %s\n", tmp, strerror(errno));
+		return 1;
+	}
+	if (fwrite(&header, sizeof(header), 1, out) != 1)
+		goto fail;
+	for (i = 0; i < nmembers; i++) {
+		if (fwrite(&members[i].entry, sizeof(members[i].entry), 1, out) != 1)
+			goto fail;
+	}
+	for (i = 0; i < nmembers; i++) {
+		if (copy_member(out, &members[i]))
+			goto fail;
+	}
+	/* pads the file to header.size when the last member is empty */
+	if (fflush(out) || ftruncate(fileno(out), offset) || fsync(fileno(out)))
+		goto fail;
+	if (fclose(out)) {
+		out = NULL;
+		goto fail;
+	}
+	if (rename(tmp, argv[2])) {
+		fprintf(stderr, "%s: %s\n", argv[2], strerror(errno));
+		unlink(tmp);
+		return 1;
+	}
+	printf("%s: %d members, %llu bytes\n", argv[2], nmembers, (unsigned long long) offset);
+	return 0;
+
+fail:
+	fprintf(stderr, "%s: %s\n", tmp, strerror(errno));
+	if (out)
+		fclose(out);
+	unlink(tmp);
+	return 1;
+}
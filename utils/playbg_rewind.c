@@ -0,0 +1,121 @@
+/*
+ * See http://www.asterisk.org for more information about
+ * the Asterisk project. Please do not directly contact
+ * any of the maintainers of this project for assistance;
+ * the project provides a web site, mailing lists and IRC
+ * channels for your use.
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+*/
+
+/*! \file
+ *
+ * \brief Compare reopening and rewinding a looping jingle
+ *
+ * playbg_rewind [loops] [ms]
+ *
+ * Plays a jingle of ms milliseconds (default 500) of 8 kHz signed
+ * linear, loops times (default 20000), the way a format module reads
+ * it: stdio, one 20 ms frame per fread(). At each loop the file is
+ * either closed and opened again, as playbg_seek() used to do, or
+ * rewound with fseek() as a parked stream is. Prints loops and opens
+ * per second of wall time for both, and what the loop boundary alone
+ * costs. The file lives in the page cache, so this is the syscall and
+ * stdio cost, not the disk's. Name resolution, which the resolve cache
+ * saves either way, is not included.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+
+#define FRAME_BYTES 320
+
+static int64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+/*!
+ * \brief Play the jingle loops times
+ * \param boundary set to the time spent moving from the end to the start
+ * \return the number of opens, -1 on failure
+ */
+static long play(const char *fn, long loops, int rewind, int64_t *boundary)
+{
+	char frame[FRAME_BYTES];
+	FILE *f;
+	long opens = 1, i;
+	int64_t start;
+
+	*boundary = 0;
+	if (!(f = fopen(fn, "r")))
+		return -1;
+	for (i = 0; i < loops; i++) {
+		while (fread(frame, 1, sizeof(frame), f) == sizeof(frame))
+			;
+		start = now_ns();
+		if (rewind) {
+			if (fseek(f, 0, SEEK_SET))
+				return -1;
+		} else {
+			fclose(f);
+			if (!(f = fopen(fn, "r")))
+				return -1;
+			opens++;
+		}
+		*boundary += now_ns() - start;
+	}
+	fclose(f);
+	return opens;
+}
+
+
+int main(int argc, char *argv[])
+{
+	char fn[] = "/tmp/playbg_rewind.XXXXXX";
+	char frame[FRAME_BYTES];
+	long loops = argc > 1 ? atol(argv[1]) : 20000;
+	int ms = argc > 2 ? atoi(argv[2]) : 500;
+	int64_t start, elapsed, boundary;
+	long opens;
+	int fd, i, mode;
+
+	if (loops <= 0 || ms < 20 || (fd = mkstemp(fn)) < 0) {
+		fprintf(stderr, "Usage: playbg_rewind [loops] [ms]\n");
+		return 1;
+	}
+	memset(frame, 0, sizeof(frame));
+	for (i = 0; i < ms / 20; i++) {
+		if (write(fd, frame, sizeof(frame)) != sizeof(frame)) {
+			perror(fn);
+			unlink(fn);
+			return 1;
+		}
+	}
+	close(fd);
+
+	for (mode = 0; mode < 2; mode++) {
+		start = now_ns();
+		if ((opens = play(fn, loops, mode, &boundary)) < 0) {
+			perror(fn);
+			unlink(fn);
+			return 1;
+		}
+		elapsed = now_ns() - start;
+		printf("%s: %ld loops of %d ms, %.0f loops/s, %.0f opens/s, %.0f ns per loop boundary\n",
+			mode ? "rewind" : "reopen", loops, ms, loops * 1e9 / elapsed,
+			(opens - 1) * 1e9 / elapsed, (double) boundary / loops);
+	}
+	unlink(fn);
+	return 0;
+}
@@ -0,0 +1,262 @@
+/*
+ * See http://www.asterisk.org for more information about
+ * the Asterisk project. Please do not directly contact
+ * any of the maintainers of this project for assistance;
+ * the project provides a web site, mailing lists and IRC
+ * channels for your use.
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+*/
+
+/*! \file
+ *
+ * \brief Compare pread() and io_uring prefetch of shared windows, cold cache
+ *
+ * playbg_uring [directory] [channels] [MB]
+ *
+ * Writes one file of MB megabytes (default 16) per channel (default 16)
+ * in directory (default .), and reads them all through, 128 kB window
+ * by window and channel by channel, as sharedfd windows are refilled:
+ * first with a pread() of each window when it is needed, then with the
+ * next window of each channel queued to io_uring while the current one
+ * is used, as uring does. Before each run the files are dropped from
+ * the page cache with posix_fadvise(DONTNEED), which does nothing on
+ * tmpfs. Prints the throughput and how long a reader waited for a
+ * window, on average and at worst.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+#define WINDOW (128 * 1024)
+
+struct channel {
+	int fd;
+	long windows;
+	unsigned char *buf[2];		/*!< window being used, window ahead */
+	int ready[2];
+	struct iovec iov[2];
+};
+
+static struct channel *channels;
+static int nchannels;
+static long nwindows;
+
+static struct {
+	int fd;
+	unsigned *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+} ring;
+
+
+static int64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+static int ring_setup(int entries)
+{
+	struct io_uring_params p;
+	void *sq, *cq;
+	size_t sq_size, cq_size;
+
+	memset(&p, 0, sizeof(p));
+	if ((ring.fd = syscall(__NR_io_uring_setup, entries, &p)) < 0)
+		return -1;
+	sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		sq_size = cq_size = sq_size > cq_size ? sq_size : cq_size;
+	sq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+	cq = (p.features & IORING_FEAT_SINGLE_MMAP) ? sq
+		: mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_CQ_RING);
+	ring.sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		ring.fd, IORING_OFF_SQES);
+	if (sq == MAP_FAILED || cq == MAP_FAILED || ring.sqes == MAP_FAILED)
+		return -1;
+	ring.sq_tail = (unsigned *) ((char *) sq + p.sq_off.tail);
+	ring.sq_mask = (unsigned *) ((char *) sq + p.sq_off.ring_mask);
+	ring.sq_array = (unsigned *) ((char *) sq + p.sq_off.array);
+	ring.cq_head = (unsigned *) ((char *) cq + p.cq_off.head);
+	ring.cq_tail = (unsigned *) ((char *) cq + p.cq_off.tail);
+	ring.cq_mask = (unsigned *) ((char *) cq + p.cq_off.ring_mask);
+	ring.cqes = (struct io_uring_cqe *) ((char *) cq + p.cq_off.cqes);
+	return 0;
+}
+
+
+/*! \brief Queue window w of channel c into its buffer slot */
+static void ring_queue(int c, int slot, long w)
+{
+	struct channel *ch = &channels[c];
+	unsigned tail = *ring.sq_tail;
+	struct io_uring_sqe *sqe = &ring.sqes[tail & *ring.sq_mask];
+
+	memset(sqe, 0, sizeof(*sqe));
+	ch->iov[slot].iov_base = ch->buf[slot];
+	ch->iov[slot].iov_len = WINDOW;
+	ch->ready[slot] = 0;
+	sqe->opcode = IORING_OP_READV;
+	sqe->fd = ch->fd;
+	sqe->off = (uint64_t) w * WINDOW;
+	sqe->addr = (unsigned long) &ch->iov[slot];
+	sqe->len = 1;
+	sqe->user_data = c * 2 + slot;
+	ring.sq_array[tail & *ring.sq_mask] = tail & *ring.sq_mask;
+	__atomic_store_n(ring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+
+/*! \brief Submit what is queued, and wait for one completion if wait */
+static void ring_enter(int submit, int wait)
+{
+	unsigned head;
+	struct io_uring_cqe *cqe;
+
+	while (syscall(__NR_io_uring_enter, ring.fd, submit, wait, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0) < 0 && errno == EINTR)
+		;
+	head = *ring.cq_head;
+	while (head != __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE)) {
+		cqe = &ring.cqes[head & *ring.cq_mask];
+		if (cqe->res != WINDOW) {
+			fprintf(stderr, "io_uring read: %s\n", cqe->res < 0 ? strerror(-cqe->res) : "short");
+			exit(1);
+		}
+		channels[cqe->user_data / 2].ready[cqe->user_data % 2] = 1;
+		head++;
+	}
+	__atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+}
+
+
+/*! \brief Touch a window the way a format module would read it */
+static unsigned use(const unsigned char *buf)
+{
+	unsigned sum = 0;
+	int i;
+
+	for (i = 0; i < WINDOW; i += 320)
+		sum += buf[i];
+	return sum;
+}
+
+
+static void drop_cache(void)
+{
+	int c;
+
+	for (c = 0; c < nchannels; c++) {
+		fdatasync(channels[c].fd);
+		posix_fadvise(channels[c].fd, 0, 0, POSIX_FADV_DONTNEED);
+	}
+}
+
+
+static void run(int uring)
+{
+	int64_t start, waited, wait_total = 0, wait_max = 0;
+	unsigned sum = 0;
+	long w;
+	int c, slot;
+
+	drop_cache();
+	start = now_ns();
+	if (uring) {
+		for (c = 0; c < nchannels; c++) {
+			ring_queue(c, 0, 0);
+			ring_queue(c, 1, 1);
+		}
+		ring_enter(nchannels * 2, 0);
+	}
+	for (w = 0; w < nwindows; w++) {
+		slot = w % 2;
+		for (c = 0; c < nchannels; c++) {
+			struct channel *ch = &channels[c];
+
+			waited = now_ns();
+			if (!uring) {
+				if (pread(ch->fd, ch->buf[0], WINDOW, (off_t) w * WINDOW) != WINDOW) {
+					perror("pread");
+					exit(1);
+				}
+			} else {
+				while (!ch->ready[slot])
+					ring_enter(0, 1);
+			}
+			waited = now_ns() - waited;
+			wait_total += waited;
+			if (waited > wait_max)
+				wait_max = waited;
+			sum += use(ch->buf[uring ? slot : 0]);
+			if (uring && w + 2 < nwindows) {
+				ring_queue(c, slot, w + 2);
+				ring_enter(1, 0);
+			}
+		}
+	}
+	printf("%-6s %5.0f MB/s, waited %6.0f us per window on average, %6.0f us at worst (%u)\n",
+		uring ? "uring" : "pread", (double) nchannels * nwindows * WINDOW / (now_ns() - start) * 1e9 / (1 << 20),
+		wait_total / 1e3 / (nchannels * nwindows), wait_max / 1e3, sum & 1);
+}
+
+
+int main(int argc, char *argv[])
+{
+	const char *dir = argc > 1 ? argv[1] : ".";
+	char fn[4096];
+	unsigned char *data;
+	long w;
+	int c;
+
+	nchannels = argc > 2 ? atoi(argv[2]) : 16;
+	nwindows = (argc > 3 ? atol(argv[3]) : 16) * (1 << 20) / WINDOW;
+	if (nchannels <= 0 || nwindows < 2) {
+		fprintf(stderr, "Usage: playbg_uring [directory] [channels] [MB]\n");
+		return 1;
+	}
+	if (ring_setup(nchannels * 2 < 4096 ? nchannels * 2 : 4096)) {
+		fprintf(stderr, "io_uring unavailable: %s\n", strerror(errno));
+		return 1;
+	}
+	if (!(channels = calloc(nchannels, sizeof(*channels))) || !(data = malloc(WINDOW)))
+		return 1;
+	memset(data, 0x55, WINDOW);
+	for (c = 0; c < nchannels; c++) {
+		snprintf(fn, sizeof(fn), "%s/playbg_uring.%d.%d", dir, (int) getpid(), c);
+		if ((channels[c].fd = open(fn, O_RDWR | O_CREAT | O_TRUNC, 0600)) < 0) {
+			perror(fn);
+			return 1;
+		}
+		unlink(fn);
+		for (w = 0; w < nwindows; w++) {
+			if (write(channels[c].fd, data, WINDOW) != WINDOW) {
+				perror(fn);
+				return 1;
+			}
+		}
+		if (!(channels[c].buf[0] = malloc(WINDOW)) || !(channels[c].buf[1] = malloc(WINDOW)))
+			return 1;
+	}
+	run(0);
+	run(1);
+	return 0;
+}